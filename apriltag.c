@@ -40,6 +40,13 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include <stdio.h>
 #include <errno.h>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #include "common/image_u8.h"
 #include "common/image_u8_parallel.h"
 #include "common/image_u8x3.h"
@@ -50,6 +57,12 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include "common/math_util.h"
 #include "common/g2d.h"
 #include "common/debug_print.h"
+#include "common/atomic_util.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define APRILTAG_SSE2
+#include <emmintrin.h>
+#endif
 
 #include "apriltag_math.h"
 
@@ -71,6 +84,34 @@ static inline long int random(void)
 
 extern zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im);
 
+// Hands out a scratch arena for a worker task to use until it returns
+// it. Arenas are returned empty.
+arena_t *apriltag_detector_borrow_arena(apriltag_detector_t *td)
+{
+    arena_t *arena;
+
+    pthread_mutex_lock(&td->mutex);
+    if (zarray_size(td->free_arenas) > 0) {
+        zarray_get(td->free_arenas, zarray_size(td->free_arenas) - 1, &arena);
+        zarray_remove_index(td->free_arenas, zarray_size(td->free_arenas) - 1, 0);
+    } else {
+        arena = arena_create(0);
+        zarray_add(td->worker_arenas, &arena);
+    }
+    pthread_mutex_unlock(&td->mutex);
+
+    return arena;
+}
+
+void apriltag_detector_return_arena(apriltag_detector_t *td, arena_t *arena)
+{
+    arena_reset(arena);
+
+    pthread_mutex_lock(&td->mutex);
+    zarray_add(td->free_arenas, &arena);
+    pthread_mutex_unlock(&td->mutex);
+}
+
 // Regresses a model of the form:
 // intensity(x,y) = C0*x + C1*y + CC2
 // The J matrix is the:
@@ -125,10 +166,99 @@ struct quick_decode_entry
     uint8_t rotation; // number of rotations [0, 3]
 };
 
+// One substring of the code bits, indexing the codes by their value
+// of those bits.
+struct quick_decode_chunk
+{
+    int shift;     // the bits (code >> shift) & mask
+    uint64_t mask;
+
+    int lognbuckets;
+    uint32_t *offsets; // [nbuckets + 1]; bucket b is ids[offsets[b]...offsets[b+1])
+    uint16_t *ids;     // [ncodes]
+};
+
+// The decode table is an open-addressing hash table of every code
+// within maxhamming errors of a codeword, packed into 8 bytes per
+// entry. Each code is stored under the smallest of its four rotations
+// (its canonical rotation), so that a quad is decoded in any rotation
+// with a single probe; the entry records how many rotations turn the
+// code into its canonical one.
+//
+// The canonical code is hashed by multiplying it by an odd constant
+// modulo 2^keybits, which is invertible, so the top lognentries bits
+// of the product (the home bucket) and the rest of them (the
+// remainder) identify it together. An entry only stores the
+// remainder, along with its distance from its home bucket (so that
+// codes from different home buckets in one run of the linear probing
+// can be told apart), the rotation, the number of errors and the id:
+//
+//   bits 63..26: remainder, 25..20: distance, 19..18: rotation,
+//   17..16: hamming, 15..0: id
+//
+// Empty entries are all ones, which is never a valid entry as ids are
+// below 65535.
+#define QUICK_DECODE_EMPTY UINT64_MAX
+#define QUICK_DECODE_HAMMING_SHIFT 16
+#define QUICK_DECODE_ROTATION_SHIFT 18
+#define QUICK_DECODE_DISTANCE_SHIFT 20
+#define QUICK_DECODE_DISTANCE_BITS 6
+#define QUICK_DECODE_REMAINDER_SHIFT 26
+#define QUICK_DECODE_REMAINDER_BITS 38
+
+struct quick_decode_table
+{
+    int nentries;      // 1 << lognentries
+    int lognentries;
+    int nbits;
+    int keybits;       // max(nbits, lognentries)
+    uint64_t *entries;
+};
+
 struct quick_decode
 {
-    int nentries;
-    struct quick_decode_entry *entries;
+    // The points quad_decode() samples, which only depend on the
+    // family, in tag coordinates ([-1, 1] at the black corners): first
+    // the nborder_samples along the inside and outside of the border,
+    // then the nbits data bits (in order). For the border, sample_i is
+    // 1 if the sample is white; for a data bit, it is the bit's index
+    // in the grid of values.
+    int nborder_samples;
+    double *sample_x, *sample_y;
+    int *sample_i;
+
+    // Lookups use tables[current]. If the decoder is built lazily,
+    // tables[0] only holds the codes within one error, and tables[1]
+    // is built with all of them on a background thread, which then
+    // sets current to 1. (tables[0] is kept until the decoder is
+    // destroyed, since lookups might still be using it.)
+    struct quick_decode_table tables[2];
+    uint32_t current;
+
+    bool building;
+    pthread_t builder;
+    uint32_t cancel;    // set to stop the builder early
+    const apriltag_family_t *family;
+
+    // If tables[0].entries is NULL, the family is too big to tabulate every
+    // code within maxhamming errors, and codes are found by
+    // multi-index hashing instead: the bits are split into
+    // maxhamming+1 chunks, so by the pigeonhole principle a code
+    // within maxhamming errors matches at least one chunk exactly.
+    int maxhamming;
+    int nchunks;
+    struct quick_decode_chunk chunks[4];
+
+    // If tables[0] was mapped from a file by
+    // apriltag_detector_add_family_bits_mapped(), the mapping that
+    // holds them (which must be unmapped rather than freed).
+    void *mapping;
+    size_t mapping_size;
+
+    // The number of detectors the family has been added to. The
+    // decoder is never modified after it is built, so any number of
+    // detectors and threads can use it at once.
+    int refcount;
 };
 
 /**
@@ -148,124 +278,444 @@ static uint64_t rotate90(uint64_t w, int numBits)
     return w;
 }
 
-static void quad_destroy(struct quad *quad)
+// Sizes the table for nbits-bit codes. Returns false if the
+// remainders wouldn't fit in an entry.
+static bool quick_decode_set_size(struct quick_decode_table *qt, int nbits, int lognentries)
 {
-    if (!quad)
-        return;
+    qt->lognentries = lognentries;
+    qt->nentries = 1 << lognentries;
+    qt->nbits = nbits;
+    qt->keybits = imax(nbits, lognentries);
 
-    matd_destroy(quad->H);
-    matd_destroy(quad->Hinv);
-    free(quad);
+    return qt->keybits - lognentries <= QUICK_DECODE_REMAINDER_BITS;
 }
 
-static struct quad *quad_copy(struct quad *quad)
+// splits the hashed code into its home bucket and remainder.
+static inline uint32_t quick_decode_hash(const struct quick_decode_table *qt, uint64_t code, uint64_t *remainder)
 {
-    struct quad *q = calloc(1, sizeof(struct quad));
-    memcpy(q, quad, sizeof(struct quad));
-    if (quad->H)
-        q->H = matd_copy(quad->H);
-    if (quad->Hinv)
-        q->Hinv = matd_copy(quad->Hinv);
-    return q;
+    uint64_t h = code * 0x9e3779b97f4a7c15ULL;
+    if (qt->keybits < 64)
+        h &= (APRILTAG_U64_ONE << qt->keybits) - 1;
+
+    int nremainder = qt->keybits - qt->lognentries;
+    *remainder = nremainder ? h & ((APRILTAG_U64_ONE << nremainder) - 1) : 0;
+    return (uint32_t) (h >> nremainder);
 }
 
-static void quick_decode_add(struct quick_decode *qd, uint64_t code, int id, int hamming)
+// Fills rotations[r] with code rotated r times and returns the index
+// of the smallest one (the first, if several are equal). *period is
+// the number of distinct rotations: 1, 2 or 4.
+static inline int canonical_rotation(uint64_t code, int nbits, uint64_t rotations[4], int *period)
 {
-    uint32_t bucket = code % qd->nentries;
+    rotations[0] = code;
+    for (int r = 1; r < 4; r++)
+        rotations[r] = rotate90(rotations[r-1], nbits);
+
+    int best = 0;
+    for (int r = 1; r < 4; r++)
+        if (rotations[r] < rotations[best])
+            best = r;
+
+    *period = rotations[1] == code ? 1 : rotations[2] == code ? 2 : 4;
+    return best;
+}
 
-    while (qd->entries[bucket].rcode != UINT64_MAX) {
-        bucket = (bucket + 1) % qd->nentries;
+// Returns false if the code lands too far from its home bucket for
+// the distance to fit in the entry.
+static bool quick_decode_add(struct quick_decode_table *qt, uint64_t code, int id, int hamming)
+{
+    uint64_t rotations[4];
+    int period;
+    uint64_t rotation = canonical_rotation(code, qt->nbits, rotations, &period);
+
+    uint64_t remainder;
+    uint32_t bucket = quick_decode_hash(qt, rotations[rotation], &remainder);
+    uint32_t mask = qt->nentries - 1;
+
+    for (uint64_t distance = 0; distance < (1 << QUICK_DECODE_DISTANCE_BITS); distance++) {
+        uint64_t *entry = &qt->entries[(bucket + distance) & mask];
+        if (*entry == QUICK_DECODE_EMPTY) {
+            *entry = (remainder << QUICK_DECODE_REMAINDER_SHIFT) |
+                (distance << QUICK_DECODE_DISTANCE_SHIFT) |
+                (rotation << QUICK_DECODE_ROTATION_SHIFT) |
+                ((uint64_t) hamming << QUICK_DECODE_HAMMING_SHIFT) | id;
+            return true;
+        }
     }
 
-    qd->entries[bucket].rcode = code;
-    qd->entries[bucket].id = id;
-    qd->entries[bucket].hamming = hamming;
+    return false;
 }
 
-static void quick_decode_uninit(apriltag_family_t *fam)
+static void unmap_file(void *mapping, size_t size);
+
+static void quick_decode_destroy(struct quick_decode *qd)
 {
-    if (!fam->impl)
-        return;
+    if (qd->building) {
+        atomic_store_u32(&qd->cancel, 1);
+        pthread_join(qd->builder, NULL);
+    }
 
-    struct quick_decode *qd = (struct quick_decode*) fam->impl;
-    free(qd->entries);
+    if (qd->mapping)
+        unmap_file(qd->mapping, qd->mapping_size);
+    else
+        free(qd->tables[0].entries);
+    free(qd->tables[1].entries);
+    free(qd->sample_x);
+    for (int c = 0; c < qd->nchunks; c++) {
+        free(qd->chunks[c].offsets);
+        free(qd->chunks[c].ids);
+    }
     free(qd);
-    fam->impl = NULL;
 }
 
-static void quick_decode_init(apriltag_family_t *family, int maxhamming)
+// Detectors sharing a family may add and remove it on different
+// threads, so the family's decoder and its reference count are only
+// changed while holding this lock. Decoders are built outside of it.
+static uint32_t quick_decode_lock;
+
+static void quick_decode_lock_acquire(void)
 {
-    assert(family->impl == NULL);
-    assert(family->ncodes < 65536);
+    while (!atomic_cas_u32(&quick_decode_lock, 0, 1))
+        ;
+}
 
-    struct quick_decode *qd = calloc(1, sizeof(struct quick_decode));
-    int capacity = family->ncodes;
+static void quick_decode_lock_release(void)
+{
+    atomic_cas_u32(&quick_decode_lock, 1, 0);
+}
+
+// adds a reference to the family's decoder. Returns false if it has
+// none yet.
+static bool quick_decode_retain(apriltag_family_t *fam)
+{
+    quick_decode_lock_acquire();
+    struct quick_decode *qd = (struct quick_decode*) fam->impl;
+    if (qd)
+        qd->refcount++;
+    quick_decode_lock_release();
+
+    return qd != NULL;
+}
+
+// makes qd the family's decoder and adds a reference to it, unless
+// another thread attached one first, in which case that one is
+// retained and qd is destroyed.
+static void quick_decode_attach(apriltag_family_t *fam, struct quick_decode *qd)
+{
+    quick_decode_lock_acquire();
+    if (fam->impl == NULL) {
+        fam->impl = qd;
+        qd = NULL;
+    }
+    ((struct quick_decode*) fam->impl)->refcount++;
+    quick_decode_lock_release();
+
+    if (qd)
+        quick_decode_destroy(qd);
+}
+
+// drops a reference to the family's decoder, destroying it with the
+// last one.
+static void quick_decode_release(apriltag_family_t *fam)
+{
+    struct quick_decode *qd = NULL;
+
+    quick_decode_lock_acquire();
+    if (fam->impl && --((struct quick_decode*) fam->impl)->refcount == 0) {
+        qd = (struct quick_decode*) fam->impl;
+        fam->impl = NULL;
+    }
+    quick_decode_lock_release();
+
+    if (qd)
+        quick_decode_destroy(qd);
+}
+
+static inline int popcount64(uint64_t x)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (int) ((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+static inline uint32_t quick_decode_chunk_bucket(const struct quick_decode_chunk *chunk, uint64_t code)
+{
+    uint64_t v = (code >> chunk->shift) & chunk->mask;
+    return (uint32_t) ((v * 0x9e3779b97f4a7c15ULL) >> (64 - chunk->lognbuckets));
+}
+
+// Computes the points that quad_decode() samples. Returns false if out
+// of memory.
+static bool quick_decode_init_samples(struct quick_decode *qd, const apriltag_family_t *family)
+{
+    // We will compute a threshold by sampling known white/black cells around this tag.
+    // This sampling is achieved by considering a set of samples along lines.
+    //
+    // coordinates are given in bit coordinates. ([0, fam->border_width]).
+    //
+    // { initial x, initial y, delta x, delta y, WHITE=1 }
+    float patterns[] = {
+        // left white column
+        -0.5, 0.5,
+        0, 1,
+        1,
+
+        // left black column
+        0.5, 0.5,
+        0, 1,
+        0,
+
+        // right white column
+        family->width_at_border + 0.5, .5,
+        0, 1,
+        1,
+
+        // right black column
+        family->width_at_border - 0.5, .5,
+        0, 1,
+        0,
 
+        // top white row
+        0.5, -0.5,
+        1, 0,
+        1,
+
+        // top black row
+        0.5, 0.5,
+        1, 0,
+        0,
+
+        // bottom white row
+        0.5, family->width_at_border + 0.5,
+        1, 0,
+        1,
+
+        // bottom black row
+        0.5, family->width_at_border - 0.5,
+        1, 0,
+        0
+
+        // XXX double-counts the corners.
+    };
+    int npatterns = sizeof(patterns)/(5*sizeof(float));
+
+    qd->nborder_samples = npatterns * family->width_at_border;
+
+    // one allocation for all three arrays.
+    int nsamples = qd->nborder_samples + family->nbits;
+    qd->sample_x = malloc((2*sizeof(double) + sizeof(int))*nsamples);
+    if (qd->sample_x == NULL)
+        return false;
+    qd->sample_y = qd->sample_x + nsamples;
+    qd->sample_i = (int*) (qd->sample_y + nsamples);
+
+    int s = 0;
+
+    for (int pattern_idx = 0; pattern_idx < npatterns; pattern_idx ++) {
+        float *pattern = &patterns[pattern_idx * 5];
+
+        for (int i = 0; i < family->width_at_border; i++) {
+            double tagx01 = (pattern[0] + i*pattern[2]) / (family->width_at_border);
+            double tagy01 = (pattern[1] + i*pattern[3]) / (family->width_at_border);
+
+            qd->sample_x[s] = 2*(tagx01-0.5);
+            qd->sample_y[s] = 2*(tagy01-0.5);
+            qd->sample_i[s] = pattern[4];
+            s++;
+        }
+    }
+
+    int min_coord = (family->width_at_border - family->total_width)/2;
+    for (uint32_t i = 0; i < family->nbits; i++) {
+        int bity = family->bit_y[i];
+        int bitx = family->bit_x[i];
+
+        double tagx01 = (bitx + 0.5) / (family->width_at_border);
+        double tagy01 = (bity + 0.5) / (family->width_at_border);
+
+        // scale to [-1, 1]
+        qd->sample_x[s] = 2*(tagx01-0.5);
+        qd->sample_y[s] = 2*(tagy01-0.5);
+        qd->sample_i[s] = family->total_width*(bity - min_coord) + bitx - min_coord;
+        s++;
+    }
+
+    return true;
+}
+
+// Builds the multi-index hash. Returns false if out of memory.
+static bool quick_decode_init_chunks(struct quick_decode *qd, const apriltag_family_t *family, int maxhamming)
+{
     int nbits = family->nbits;
 
+    qd->maxhamming = maxhamming;
+    qd->nchunks = imin(maxhamming + 1, nbits);
+
+    int lognbuckets = 1;
+    while ((1u << lognbuckets) < family->ncodes)
+        lognbuckets++;
+    uint32_t nbuckets = 1u << lognbuckets;
+
+    for (int c = 0; c < qd->nchunks; c++) {
+        struct quick_decode_chunk *chunk = &qd->chunks[c];
+
+        // split the bits as evenly as possible.
+        int b0 = c * nbits / qd->nchunks;
+        int b1 = (c + 1) * nbits / qd->nchunks;
+        chunk->shift = b0;
+        chunk->mask = (b1 - b0 == 64) ? UINT64_MAX : (APRILTAG_U64_ONE << (b1 - b0)) - 1;
+        chunk->lognbuckets = lognbuckets;
+
+        chunk->offsets = calloc(nbuckets + 1, sizeof(uint32_t));
+        chunk->ids = malloc(sizeof(uint16_t)*imax(family->ncodes, 1));
+        if (chunk->offsets == NULL || chunk->ids == NULL)
+            return false;
+
+        // a counting sort of the codes by bucket.
+        for (uint32_t i = 0; i < family->ncodes; i++)
+            chunk->offsets[quick_decode_chunk_bucket(chunk, family->codes[i]) + 1]++;
+        for (uint32_t b = 0; b < nbuckets; b++)
+            chunk->offsets[b + 1] += chunk->offsets[b];
+        for (uint32_t i = 0; i < family->ncodes; i++)
+            chunk->ids[chunk->offsets[quick_decode_chunk_bucket(chunk, family->codes[i])]++] = i;
+
+        // the offsets now point to the ends of the buckets.
+        for (uint32_t b = nbuckets; b > 0; b--)
+            chunk->offsets[b] = chunk->offsets[b - 1];
+        chunk->offsets[0] = 0;
+    }
+
+    return true;
+}
+
+// finds the closest code within qd->maxhamming errors of rcode (the
+// lowest id among equally close ones). Returns false if there is none.
+static bool quick_decode_lookup_chunks(const struct quick_decode *qd, const apriltag_family_t *family,
+                                       uint64_t rcode, struct quick_decode_entry *entry)
+{
+    int best_hamming = qd->maxhamming + 1;
+    int best_id = 0;
+
+    for (int c = 0; c < qd->nchunks; c++) {
+        const struct quick_decode_chunk *chunk = &qd->chunks[c];
+        uint64_t v = (rcode >> chunk->shift) & chunk->mask;
+        uint32_t b = quick_decode_chunk_bucket(chunk, rcode);
+
+        for (uint32_t k = chunk->offsets[b]; k < chunk->offsets[b + 1]; k++) {
+            int id = chunk->ids[k];
+            uint64_t code = family->codes[id];
+
+            if (((code >> chunk->shift) & chunk->mask) != v)
+                continue;
+
+            int hamming = popcount64(code ^ rcode);
+            if (hamming < best_hamming || (hamming == best_hamming && id < best_id)) {
+                best_hamming = hamming;
+                best_id = id;
+            }
+        }
+    }
+
+    if (best_hamming > qd->maxhamming)
+        return false;
+
+    entry->rcode = rcode;
+    entry->id = best_id;
+    entry->hamming = best_hamming;
+    return true;
+}
+
+// returns log2 of the size of the table of the codes within
+// maxhamming errors of family's codewords.
+static int quick_decode_table_logsize(const apriltag_family_t *family, int maxhamming)
+{
+    int64_t nbits = family->nbits;
+
+    // the number of codes within maxhamming errors of each codeword.
+    int64_t capacity = 1;
+
     if (maxhamming >= 1)
-        capacity += family->ncodes * nbits;
+        capacity += nbits;
 
     if (maxhamming >= 2)
-        capacity += family->ncodes * nbits * (nbits-1);
+        capacity += nbits * (nbits-1) / 2;
 
     if (maxhamming >= 3)
-        capacity += family->ncodes * nbits * (nbits-1) * (nbits-2);
+        capacity += nbits * (nbits-1) * (nbits-2) / 6;
 
-    qd->nentries = capacity * 3;
+    capacity *= family->ncodes;
 
-//    debug_print("capacity %d, size: %.0f kB\n",
-//           capacity, qd->nentries * sizeof(struct quick_decode_entry) / 1024.0);
+    // keep the table between an eighth and a quarter full, so that
+    // the probing for codes that aren't there (most of them) stops
+    // quickly.
+    int lognentries = 1;
+    while ((INT64_C(1) << lognentries) < 4 * capacity)
+        lognentries++;
+    return imax(lognentries, (int) nbits - QUICK_DECODE_REMAINDER_BITS);
+}
 
-    qd->entries = calloc(qd->nentries, sizeof(struct quick_decode_entry));
-    if (qd->entries == NULL) {
-        debug_print("Failed to allocate hamming decode table\n");
-        // errno already set to ENOMEM (Error No MEMory) by calloc() failure
-        return;
-    }
+// fills qt with the codes within maxhamming errors of family's
+// codewords. Returns false if out of memory, or if *cancel (if given)
+// was set before it finished.
+static bool quick_decode_table_build(struct quick_decode_table *qt, const apriltag_family_t *family,
+                                     int maxhamming, const uint32_t *cancel)
+{
+    int nbits = family->nbits;
 
-    for (int i = 0; i < qd->nentries; i++)
-        qd->entries[i].rcode = UINT64_MAX;
+    // If some code lands too far from its home bucket, which is very
+    // unlikely, start over with a table twice the size.
+    bool ok = false;
+    for (int lognentries = quick_decode_table_logsize(family, maxhamming); !ok && lognentries <= 30; lognentries++) {
+        quick_decode_set_size(qt, nbits, lognentries);
 
-    errno = 0;
+//        debug_print("size: %.0f kB\n", qt->nentries * sizeof(uint64_t) / 1024.0);
 
-    for (uint32_t i = 0; i < family->ncodes; i++) {
-        uint64_t code = family->codes[i];
+        free(qt->entries);
+        qt->entries = malloc(qt->nentries * sizeof(uint64_t));
+        if (qt->entries == NULL)
+            return false;
 
-        // add exact code (hamming = 0)
-        quick_decode_add(qd, code, i, 0);
+        for (int i = 0; i < qt->nentries; i++)
+            qt->entries[i] = QUICK_DECODE_EMPTY;
 
-        if (maxhamming >= 1) {
-            // add hamming 1
-            for (int j = 0; j < nbits; j++)
-                quick_decode_add(qd, code ^ (APRILTAG_U64_ONE << j), i, 1);
-        }
+        ok = true;
+        for (uint32_t i = 0; ok && i < family->ncodes; i++) {
+            if (cancel && atomic_load_u32(cancel))
+                return false;
 
-        if (maxhamming >= 2) {
-            // add hamming 2
-            for (int j = 0; j < nbits; j++)
-                for (int k = 0; k < j; k++)
-                    quick_decode_add(qd, code ^ (APRILTAG_U64_ONE << j) ^ (APRILTAG_U64_ONE << k), i, 2);
-        }
+            uint64_t code = family->codes[i];
 
-        if (maxhamming >= 3) {
-            // add hamming 3
-            for (int j = 0; j < nbits; j++)
-                for (int k = 0; k < j; k++)
-                    for (int m = 0; m < k; m++)
-                        quick_decode_add(qd, code ^ (APRILTAG_U64_ONE << j) ^ (APRILTAG_U64_ONE << k) ^ (APRILTAG_U64_ONE << m), i, 3);
-        }
+            // add exact code (hamming = 0)
+            ok &= quick_decode_add(qt, code, i, 0);
 
-        if (maxhamming > 3) {
-            debug_print("\"maxhamming\" beyond 3 not supported\n");
-            // set errno to Error INvalid VALue
-            errno = EINVAL;
-            return;
+            if (maxhamming >= 1) {
+                // add hamming 1
+                for (int j = 0; j < nbits; j++)
+                    ok &= quick_decode_add(qt, code ^ (APRILTAG_U64_ONE << j), i, 1);
+            }
+
+            if (maxhamming >= 2) {
+                // add hamming 2
+                for (int j = 0; j < nbits; j++)
+                    for (int k = 0; k < j; k++)
+                        ok &= quick_decode_add(qt, code ^ (APRILTAG_U64_ONE << j) ^ (APRILTAG_U64_ONE << k), i, 2);
+            }
+
+            if (maxhamming >= 3) {
+                // add hamming 3
+                for (int j = 0; j < nbits; j++)
+                    for (int k = 0; k < j; k++)
+                        for (int m = 0; m < k; m++)
+                            ok &= quick_decode_add(qt, code ^ (APRILTAG_U64_ONE << j) ^ (APRILTAG_U64_ONE << k) ^ (APRILTAG_U64_ONE << m), i, 3);
+            }
         }
     }
 
-    family->impl = qd;
-
     #if 0
         int longest_run = 0;
         int run = 0;
@@ -274,8 +724,8 @@ static void quick_decode_init(apriltag_family_t *family, int maxhamming)
 
         // This accounting code doesn't check the last possible run that
         // occurs at the wrap-around. That's pretty insignificant.
-        for (int i = 0; i < qd->nentries; i++) {
-            if (qd->entries[i].rcode == UINT64_MAX) {
+        for (int i = 0; i < qt->nentries; i++) {
+            if (qt->entries[i] == QUICK_DECODE_EMPTY) {
                 if (run > 0) {
                     run_sum += run;
                     run_count ++;
@@ -289,6 +739,85 @@ static void quick_decode_init(apriltag_family_t *family, int maxhamming)
 
         printf("quick decode: longest run: %d, average run %.3f\n", longest_run, 1.0 * run_sum / run_count);
     #endif
+
+    return ok;
+}
+
+static void *quick_decode_build_task(void *p)
+{
+    struct quick_decode *qd = (struct quick_decode*) p;
+
+    if (quick_decode_table_build(&qd->tables[1], qd->family, qd->maxhamming, &qd->cancel))
+        atomic_store_release_u32(&qd->current, 1);
+    else if (!atomic_load_u32(&qd->cancel))
+        debug_print("Failed to build hamming decode table\n");
+
+    return NULL;
+}
+
+// builds the decoder of family. If lazy, only the codes within one
+// error are tabulated before returning, and the rest in the
+// background. Returns NULL (with errno set) on failure.
+static struct quick_decode *quick_decode_init(const apriltag_family_t *family, int maxhamming, size_t max_table_bytes,
+                                              bool lazy)
+{
+    assert(family->ncodes < 65536);
+
+    if (maxhamming > 3) {
+        debug_print("\"maxhamming\" beyond 3 not supported\n");
+        // set errno to Error INvalid VALue
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct quick_decode *qd = calloc(1, sizeof(struct quick_decode));
+    if (qd == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    qd->maxhamming = maxhamming;
+
+    if (!quick_decode_init_samples(qd, family)) {
+        quick_decode_destroy(qd);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    int lognentries = quick_decode_table_logsize(family, maxhamming);
+    if (lognentries > 30 || (uint64_t) sizeof(uint64_t) << lognentries > max_table_bytes) {
+        if (!quick_decode_init_chunks(qd, family, maxhamming)) {
+            debug_print("Failed to allocate hamming decode index\n");
+            quick_decode_destroy(qd);
+            errno = ENOMEM;
+            return NULL;
+        }
+        errno = 0;
+        return qd;
+    }
+
+    lazy = lazy && maxhamming >= 2;
+
+    bool ok = quick_decode_table_build(&qd->tables[0], family, lazy ? 1 : maxhamming, NULL);
+
+    if (ok && lazy) {
+        qd->family = family;
+        if (pthread_create(&qd->builder, NULL, quick_decode_build_task, qd) == 0) {
+            qd->building = true;
+        } else {
+            ok = quick_decode_table_build(&qd->tables[1], family, maxhamming, NULL);
+            qd->current = 1;
+        }
+    }
+
+    if (!ok) {
+        debug_print("Failed to allocate hamming decode table\n");
+        quick_decode_destroy(qd);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    errno = 0;
+    return qd;
 }
 
 // returns an entry with hamming set to 255 if no decode was found.
@@ -298,20 +827,55 @@ static void quick_decode_codeword(apriltag_family_t *tf, uint64_t rcode,
     struct quick_decode *qd = (struct quick_decode*) tf->impl;
 
     // qd might be null if detector_add_family_bits() failed
-    for (int ridx = 0; qd != NULL && ridx < 4; ridx++) {
-
-        for (int bucket = rcode % qd->nentries;
-             qd->entries[bucket].rcode != UINT64_MAX;
-             bucket = (bucket + 1) % qd->nentries) {
+    for (int ridx = 0; qd != NULL && qd->tables[0].entries == NULL && ridx < 4; ridx++) {
+        if (quick_decode_lookup_chunks(qd, tf, rcode, entry)) {
+            entry->rotation = ridx;
+            return;
+        }
+        rcode = rotate90(rcode, tf->nbits);
+    }
 
-            if (qd->entries[bucket].rcode == rcode) {
-                *entry = qd->entries[bucket];
-                entry->rotation = ridx;
-                return;
+    if (qd != NULL && qd->tables[0].entries != NULL) {
+        const struct quick_decode_table *qt = &qd->tables[atomic_load_acquire_u32(&qd->current)];
+
+        uint64_t rotations[4];
+        int period;
+        int rotation = canonical_rotation(rcode, tf->nbits, rotations, &period);
+
+        uint64_t remainder;
+        uint32_t bucket = quick_decode_hash(qt, rotations[rotation], &remainder);
+        uint32_t mask = qt->nentries - 1;
+        uint64_t key = remainder << QUICK_DECODE_DISTANCE_BITS;
+
+        // An entry matches if it has the canonical code's remainder and
+        // lies as far from its home bucket as we have probed. The
+        // entries of up to four codes with the same canonical rotation
+        // can match; as when trying each rotation of rcode in turn, the
+        // one needing the fewest rotations of rcode wins.
+        int best_ridx = 4;
+        uint64_t best = 0;
+
+        for (uint64_t distance = 0; distance < (1 << QUICK_DECODE_DISTANCE_BITS); distance++) {
+            uint64_t e = qt->entries[(bucket + distance) & mask];
+            if (e == QUICK_DECODE_EMPTY)
+                break;
+
+            if ((e >> QUICK_DECODE_DISTANCE_SHIFT) == (key | distance)) {
+                int ridx = (rotation - (int) ((e >> QUICK_DECODE_ROTATION_SHIFT) & 3) + 4) % period;
+                if (ridx < best_ridx) {
+                    best_ridx = ridx;
+                    best = e;
+                }
             }
         }
 
-        rcode = rotate90(rcode, tf->nbits);
+        if (best_ridx < 4) {
+            entry->rcode = rotations[best_ridx];
+            entry->id = best & 0xffff;
+            entry->hamming = (best >> QUICK_DECODE_HAMMING_SHIFT) & 3;
+            entry->rotation = best_ridx;
+            return;
+        }
     }
 
     entry->rcode = 0;
@@ -320,26 +884,266 @@ static void quick_decode_codeword(apriltag_family_t *tf, uint64_t rcode,
     entry->rotation = 0;
 }
 
+// A quick_decode table saved by apriltag_family_save_decode_table()
+// is this header followed by the nentries entries exactly as they are
+// in memory, so it can be mapped and used in place. The header records
+// the byte order and entry size, since such a file only works on
+// machines that agree on both.
+#define QUICK_DECODE_FILE_MAGIC "aprilqd"
+#define QUICK_DECODE_FILE_VERSION 3
+#define QUICK_DECODE_FILE_BYTE_ORDER 0x01020304
+
+struct quick_decode_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t entry_size;
+    uint32_t nbits;
+    uint32_t ncodes;
+    uint32_t maxhamming;
+
+    // identifies the codes the table was built from, so that it isn't
+    // used with a different family of the same size.
+    uint64_t codes_hash;
+    uint64_t nentries;
+
+    char name[64]; // the family name, for information only
+    uint8_t reserved[16];
+};
+
+static uint64_t quick_decode_codes_hash(const apriltag_family_t *family)
+{
+    // FNV-1a over the bytes of the codes.
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (uint32_t i = 0; i < family->ncodes; i++) {
+        for (int b = 0; b < 64; b += 8) {
+            hash ^= (family->codes[i] >> b) & 0xff;
+            hash *= 0x100000001b3ULL;
+        }
+    }
+    return hash;
+}
+
+static void quick_decode_file_header_init(struct quick_decode_file_header *hdr, const apriltag_family_t *family,
+                                          int maxhamming, uint64_t nentries)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, QUICK_DECODE_FILE_MAGIC, sizeof(hdr->magic));
+    hdr->version = QUICK_DECODE_FILE_VERSION;
+    hdr->byte_order = QUICK_DECODE_FILE_BYTE_ORDER;
+    hdr->entry_size = sizeof(uint64_t);
+    hdr->nbits = family->nbits;
+    hdr->ncodes = family->ncodes;
+    hdr->maxhamming = maxhamming;
+    hdr->codes_hash = quick_decode_codes_hash(family);
+    hdr->nentries = nentries;
+    if (family->name)
+        strncpy(hdr->name, family->name, sizeof(hdr->name) - 1);
+}
+
+// maps the whole file read-only. Returns NULL (with errno set) on
+// failure.
+static void *map_file(const char *path, size_t *size)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    void *mapping = NULL;
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0 &&
+        (uint64_t) file_size.QuadPart <= SIZE_MAX) {
+        HANDLE view = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (view != NULL) {
+            mapping = MapViewOfFile(view, FILE_MAP_READ, 0, 0, 0);
+            // the view keeps the file mapping open.
+            CloseHandle(view);
+        }
+        *size = (size_t) file_size.QuadPart;
+    }
+    CloseHandle(file);
+
+    if (mapping == NULL)
+        errno = EIO;
+    return mapping;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    void *mapping = NULL;
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED)
+            mapping = NULL;
+        *size = st.st_size;
+    }
+
+    int err = errno;
+    close(fd);
+    errno = err;
+    return mapping;
+#endif
+}
+
+static void unmap_file(void *mapping, size_t size)
+{
+#ifdef _WIN32
+    (void) size;
+    UnmapViewOfFile(mapping);
+#else
+    munmap(mapping, size);
+#endif
+}
+
+// maps a table saved by apriltag_family_save_decode_table(). Returns
+// NULL (with errno set) if the file can't be mapped or doesn't hold
+// the table of family with maxhamming bits corrected. The entries
+// themselves are trusted.
+static struct quick_decode *quick_decode_map(const apriltag_family_t *family, int maxhamming, const char *path)
+{
+    size_t size = 0;
+    void *mapping = map_file(path, &size);
+    if (mapping == NULL) {
+        debug_print("Failed to map decode table %s\n", path);
+        return NULL;
+    }
+
+    const struct quick_decode_file_header *hdr = mapping;
+    struct quick_decode_file_header expected;
+    quick_decode_file_header_init(&expected, family, maxhamming, 0);
+
+    if (size < sizeof(*hdr) ||
+        memcmp(hdr->magic, expected.magic, sizeof(hdr->magic)) ||
+        hdr->version != expected.version ||
+        hdr->byte_order != expected.byte_order ||
+        hdr->entry_size != expected.entry_size ||
+        hdr->nbits != expected.nbits ||
+        hdr->ncodes != expected.ncodes ||
+        hdr->maxhamming != expected.maxhamming ||
+        hdr->codes_hash != expected.codes_hash ||
+        hdr->nentries == 0 || hdr->nentries > (1 << 30) || (hdr->nentries & (hdr->nentries - 1)) ||
+        hdr->nentries > (size - sizeof(*hdr)) / sizeof(uint64_t)) {
+        debug_print("%s is not a decode table of %s with %d bits corrected\n", path, family->name, maxhamming);
+        unmap_file(mapping, size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct quick_decode *qd = calloc(1, sizeof(struct quick_decode));
+    if (qd == NULL) {
+        unmap_file(mapping, size);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    int lognentries = 0;
+    while ((UINT64_C(1) << lognentries) < hdr->nentries)
+        lognentries++;
+
+    if (!quick_decode_set_size(&qd->tables[0], family->nbits, lognentries) ||
+        !quick_decode_init_samples(qd, family)) {
+        free(qd->sample_x);
+        free(qd);
+        unmap_file(mapping, size);
+        errno = EINVAL;
+        return NULL;
+    }
+    qd->tables[0].entries = (uint64_t*) ((char*) mapping + sizeof(*hdr));
+    qd->mapping = mapping;
+    qd->mapping_size = size;
+    return qd;
+}
+
 static inline int detection_compare_function(const void *_a, const void *_b)
 {
-    apriltag_detection_t *a = *(apriltag_detection_t**) _a;
-    apriltag_detection_t *b = *(apriltag_detection_t**) _b;
+    const apriltag_detection_result_t *a = _a;
+    const apriltag_detection_result_t *b = _b;
 
     return a->id - b->id;
 }
 
 void apriltag_detector_remove_family(apriltag_detector_t *td, apriltag_family_t *fam)
 {
-    quick_decode_uninit(fam);
-    zarray_remove_value(td->tag_families, &fam, 0);
+    if (zarray_remove_value(td->tag_families, &fam, 0))
+        quick_decode_release(fam);
 }
 
 void apriltag_detector_add_family_bits(apriltag_detector_t *td, apriltag_family_t *fam, int bits_corrected)
 {
+    if (!quick_decode_retain(fam)) {
+        struct quick_decode *qd = quick_decode_init(fam, bits_corrected, td->max_decode_table_bytes,
+                                                     td->lazy_decode_tables);
+        if (qd == NULL)
+            return;
+        quick_decode_attach(fam, qd);
+    }
+
     zarray_add(td->tag_families, &fam);
+    errno = 0;
+}
+
+int apriltag_detector_add_family_bits_mapped(apriltag_detector_t *td, apriltag_family_t *fam, int bits_corrected,
+                                             const char *path)
+{
+    if (!quick_decode_retain(fam)) {
+        struct quick_decode *qd = quick_decode_map(fam, bits_corrected, path);
+        if (qd == NULL)
+            return -1;
+        quick_decode_attach(fam, qd);
+    }
 
-    if (!fam->impl)
-        quick_decode_init(fam, bits_corrected);
+    zarray_add(td->tag_families, &fam);
+    errno = 0;
+    return 0;
+}
+
+int apriltag_family_save_decode_table(apriltag_family_t *fam, int bits_corrected, const char *path)
+{
+    struct quick_decode *qd = quick_decode_init(fam, bits_corrected, SIZE_MAX, false);
+    if (qd == NULL)
+        return -1;
+
+    const struct quick_decode_table *qt = &qd->tables[0];
+    if (qt->entries == NULL) {
+        // too big to tabulate at all.
+        quick_decode_destroy(qd);
+        errno = EFBIG;
+        return -1;
+    }
+
+    struct quick_decode_file_header hdr;
+    quick_decode_file_header_init(&hdr, fam, bits_corrected, qt->nentries);
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        int err = errno;
+        quick_decode_destroy(qd);
+        errno = err;
+        return -1;
+    }
+
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+        fwrite(qt->entries, sizeof(uint64_t), qt->nentries, f) == (size_t) qt->nentries;
+    if (fclose(f) != 0)
+        ok = false;
+
+    int err = errno;
+    quick_decode_destroy(qd);
+
+    if (!ok) {
+        remove(path);
+        errno = err ? err : EIO;
+        return -1;
+    }
+
+    errno = 0;
+    return 0;
 }
 
 void apriltag_detector_clear_families(apriltag_detector_t *td)
@@ -347,7 +1151,7 @@ void apriltag_detector_clear_families(apriltag_detector_t *td)
     for (int i = 0; i < zarray_size(td->tag_families); i++) {
         apriltag_family_t *fam;
         zarray_get(td->tag_families, i, &fam);
-        quick_decode_uninit(fam);
+        quick_decode_release(fam);
     }
     zarray_clear(td->tag_families);
 }
@@ -358,6 +1162,7 @@ apriltag_detector_t *apriltag_detector_create()
 
     td->nthreads = 1;
     td->quad_decimate = 2.0;
+    td->max_decode_table_bytes = 256 << 20;
     td->quad_sigma = 0.0;
 
     td->qtp.max_nmaxima = 10;
@@ -367,15 +1172,28 @@ apriltag_detector_t *apriltag_detector_create()
     td->qtp.cos_critical_rad = cos(10 * M_PI / 180);
     td->qtp.deglitch = false;
     td->qtp.min_white_black_diff = 5;
+    td->qtp.fused_threshold = true;
+    td->qtp.packed_threshold = true;
+    td->qtp.run_length_components = true;
+    td->qtp.sorted_clusters = false;
+    td->qtp.merge_cluster_points = false;
 
     td->tag_families = zarray_create(sizeof(apriltag_family_t*));
 
+    td->results = zarray_create(sizeof(apriltag_detection_result_t));
+
+    td->frame_arena = arena_create(0);
+    td->worker_arenas = zarray_create(sizeof(arena_t*));
+    td->free_arenas = zarray_create(sizeof(arena_t*));
+
     pthread_mutex_init(&td->mutex, NULL);
 
     td->tp = timeprofile_create();
 
     td->refine_edges = true;
     td->decode_sharpening = 0.25;
+    td->fixed_point_sampling = false;
+    td->refine_edges_skip_mse = 0;
 
 
     td->debug = false;
@@ -393,10 +1211,39 @@ void apriltag_detector_destroy(apriltag_detector_t *td)
 
     apriltag_detector_clear_families(td);
 
+    zarray_destroy(td->results);
+
+    arena_destroy(td->frame_arena);
+    for (int i = 0; i < zarray_size(td->worker_arenas); i++) {
+        arena_t *arena;
+        zarray_get(td->worker_arenas, i, &arena);
+        arena_destroy(arena);
+    }
+    zarray_destroy(td->worker_arenas);
+    zarray_destroy(td->free_arenas);
+
     zarray_destroy(td->tag_families);
     free(td);
 }
 
+void apriltag_detector_reserve_scratch(apriltag_detector_t *td, size_t frame_bytes, size_t worker_bytes)
+{
+    arena_reset(td->frame_arena);
+    arena_reserve(td->frame_arena, frame_bytes);
+
+    while (zarray_size(td->worker_arenas) < td->nthreads) {
+        arena_t *arena = arena_create(0);
+        zarray_add(td->worker_arenas, &arena);
+        zarray_add(td->free_arenas, &arena);
+    }
+
+    for (int i = 0; i < zarray_size(td->worker_arenas); i++) {
+        arena_t *arena;
+        zarray_get(td->worker_arenas, i, &arena);
+        arena_reserve(arena, worker_bytes);
+    }
+}
+
 struct quad_decode_task
 {
     int i0, i1;
@@ -404,7 +1251,11 @@ struct quad_decode_task
     apriltag_detector_t *td;
 
     image_u8_t *im;
-    zarray_t *detections;
+
+    // the task's own output, with room for a detection per family for
+    // each of its quads.
+    apriltag_detection_result_t *results;
+    int nresults;
 
     image_u8_t *im_samples;
 };
@@ -534,130 +1385,117 @@ static double value_for_pixel(image_u8_t *im, double px, double py) {
             im->buf[y2*im->stride + x2]*x*y;
 }
 
-static void sharpen(apriltag_detector_t* td, double* values, int size) {
-    double *sharpened = malloc(sizeof(double)*size*size);
-    double kernel[9] = {
-        0, -1, 0,
-        -1, 4, -1,
-        0, -1, 0
-    };
+// Fixed-point pixel coordinates have 16 fractional bits, of which the
+// top 8 are used as the interpolation weights. Out-of-range values
+// saturate, so that wild projections are merely out of bounds.
+static inline int32_t fixed_from_double(double v)
+{
+    return (int32_t) floor(fmin(fmax(v*65536 + 0.5, -2147418112.0), 2147418112.0));
+}
+
+// Whether fixed_bilinear() can sample at (fx, fy).
+static inline bool fixed_bilinear_inside(const image_u8_t *im, int32_t fx, int32_t fy)
+{
+    return fx >= 0 && fy >= 0 && (fx >> 16) + 1 < im->width && (fy >> 16) + 1 < im->height;
+}
+
+// Bilinear interpolation at (fx, fy), where integer coordinates are
+// pixel centers. Returns 65536 times the interpolated value. No bounds
+// checks: see fixed_bilinear_inside().
+static inline int fixed_bilinear(const image_u8_t *im, int32_t fx, int32_t fy)
+{
+    int ax = (fx >> 8) & 0xff, ay = (fy >> 8) & 0xff;
+    const uint8_t *p = &im->buf[(fy >> 16)*im->stride + (fx >> 16)];
+    int top = p[0]*(256 - ax) + p[1]*ax;
+    int bottom = p[im->stride]*(256 - ax) + p[im->stride + 1]*ax;
+    return top*(256 - ay) + bottom*ay;
+}
+
+// Whether fixed-point coordinates can address the whole of im, with
+// room to spare for samples somewhat outside it.
+static inline bool fixed_bilinear_supported(const image_u8_t *im)
+{
+    return im->width <= 16384 && im->height <= 16384;
+}
+
+// The largest total_width whose sharpening fits in a buffer on the
+// stack. The bundled families go up to 11.
+#define SHARPEN_MAX_STACK_WIDTH 14
+
+static void sharpen(apriltag_detector_t* td, double* values, int size, arena_t *arena) {
+    if (td->decode_sharpening == 0)
+        return;
+
+    // a copy of values with a border of zeros, so that the kernel
+    // needs no bounds checks.
+    int padded = size + 2;
+    double stack_buf[(SHARPEN_MAX_STACK_WIDTH + 2)*(SHARPEN_MAX_STACK_WIDTH + 2)];
+    double *buf = size <= SHARPEN_MAX_STACK_WIDTH ? stack_buf : arena_alloc(arena, sizeof(double)*padded*padded);
 
+    memset(buf, 0, sizeof(double)*padded);
+    memset(buf + (padded - 1)*padded, 0, sizeof(double)*padded);
     for (int y = 0; y < size; y++) {
-        for (int x = 0; x < size; x++) {
-            sharpened[y*size + x] = 0;
-            for (int i = 0; i < 3; i++) {
-                for (int j = 0; j < 3; j++) {
-                    if ((y + i - 1) < 0 || (y + i - 1) > size - 1 || (x + j - 1) < 0 || (x + j - 1) > size - 1) {
-                        continue;
-                    }
-                    sharpened[y*size + x] += values[(y + i - 1)*size + (x + j - 1)]*kernel[i*3 + j];
-                }
-            }
-        }
+        double *row = buf + (y + 1)*padded;
+        row[0] = 0;
+        memcpy(row + 1, values + y*size, sizeof(double)*size);
+        row[padded - 1] = 0;
     }
 
-
+    // the kernel is
+    //     0, -1,  0,
+    //    -1,  4, -1,
+    //     0, -1,  0
+    // and the terms are summed in the same order as a plain 3x3
+    // convolution would.
     for (int y = 0; y < size; y++) {
+        const double *row = buf + (y + 1)*padded + 1;
         for (int x = 0; x < size; x++) {
-            values[y*size + x] = values[y*size + x] + td->decode_sharpening*sharpened[y*size + x];
+            double sharpened = -row[x - padded] - row[x - 1] + 4*row[x] - row[x + 1] - row[x + padded];
+            values[y*size + x] = row[x] + td->decode_sharpening*sharpened;
         }
     }
-
-    free(sharpened);
 }
 
-// returns the decision margin. Return < 0 if the detection should be rejected.
-static float quad_decode(apriltag_detector_t* td, apriltag_family_t *family, image_u8_t *im, struct quad *quad, struct quick_decode_entry *entry, image_u8_t *im_samples)
+// returns the decision margin. Return < 0 if the detection should be
+// rejected. Temporary buffers are taken from arena and not released.
+static float quad_decode(apriltag_detector_t* td, apriltag_family_t *family, image_u8_t *im, struct quad *quad, struct quick_decode_entry *entry, image_u8_t *im_samples, arena_t *arena)
 {
     // decode the tag binary contents by sampling the pixel
     // closest to the center of each bit cell.
-
-    // We will compute a threshold by sampling known white/black cells around this tag.
-    // This sampling is achieved by considering a set of samples along lines.
-    //
-    // coordinates are given in bit coordinates. ([0, fam->border_width]).
-    //
-    // { initial x, initial y, delta x, delta y, WHITE=1 }
-    float patterns[] = {
-        // left white column
-        -0.5, 0.5,
-        0, 1,
-        1,
-
-        // left black column
-        0.5, 0.5,
-        0, 1,
-        0,
-
-        // right white column
-        family->width_at_border + 0.5, .5,
-        0, 1,
-        1,
-
-        // right black column
-        family->width_at_border - 0.5, .5,
-        0, 1,
-        0,
-
-        // top white row
-        0.5, -0.5,
-        1, 0,
-        1,
-
-        // top black row
-        0.5, 0.5,
-        1, 0,
-        0,
-
-        // bottom white row
-        0.5, family->width_at_border + 0.5,
-        1, 0,
-        1,
-
-        // bottom black row
-        0.5, family->width_at_border - 0.5,
-        1, 0,
-        0
-
-        // XXX double-counts the corners.
-    };
+    const struct quick_decode *qd = (const struct quick_decode*) family->impl;
 
     struct graymodel whitemodel, blackmodel;
     graymodel_init(&whitemodel);
     graymodel_init(&blackmodel);
 
-    for (long unsigned int pattern_idx = 0; pattern_idx < sizeof(patterns)/(5*sizeof(float)); pattern_idx ++) {
-        float *pattern = &patterns[pattern_idx * 5];
-
-        int is_white = pattern[4];
-
-        for (int i = 0; i < family->width_at_border; i++) {
-            double tagx01 = (pattern[0] + i*pattern[2]) / (family->width_at_border);
-            double tagy01 = (pattern[1] + i*pattern[3]) / (family->width_at_border);
-
-            double tagx = 2*(tagx01-0.5);
-            double tagy = 2*(tagy01-0.5);
+    // the image coordinates of the samples.
+    int nsamples = qd->nborder_samples + family->nbits;
+    double *sample_px = arena_alloc(arena, sizeof(double)*nsamples);
+    double *sample_py = arena_alloc(arena, sizeof(double)*nsamples);
 
-            double px, py;
-            homography_project(quad->H, tagx, tagy, &px, &py);
+    homography_project_n(quad->H->data, qd->sample_x, qd->sample_y, qd->nborder_samples, sample_px, sample_py);
 
-            // don't round
-            int ix = px;
-            int iy = py;
-            if (ix < 0 || iy < 0 || ix >= im->width || iy >= im->height)
-                continue;
+    for (int s = 0; s < qd->nborder_samples; s++) {
+        double tagx = qd->sample_x[s];
+        double tagy = qd->sample_y[s];
+        int is_white = qd->sample_i[s];
 
-            int v = im->buf[iy*im->stride + ix];
+        // don't round
+        int ix = sample_px[s];
+        int iy = sample_py[s];
+        if (ix < 0 || iy < 0 || ix >= im->width || iy >= im->height)
+            continue;
 
-            if (im_samples) {
-                im_samples->buf[iy*im_samples->stride + ix] = (1-is_white)*255;
-            }
+        int v = im->buf[iy*im->stride + ix];
 
-            if (is_white)
-                graymodel_add(&whitemodel, tagx, tagy, v);
-            else
-                graymodel_add(&blackmodel, tagx, tagy, v);
+        if (im_samples) {
+            im_samples->buf[iy*im_samples->stride + ix] = (1-is_white)*255;
         }
+
+        if (is_white)
+            graymodel_add(&whitemodel, tagx, tagy, v);
+        else
+            graymodel_add(&blackmodel, tagx, tagy, v);
     }
 
     if (family->width_at_border > 1) {
@@ -684,31 +1522,51 @@ static float quad_decode(apriltag_detector_t* td, apriltag_family_t *family, ima
     float black_score = 0, white_score = 0;
     float black_score_count = 1, white_score_count = 1;
 
-    double *values = calloc(family->total_width*family->total_width, sizeof(double));
+    double *values = arena_calloc(arena, family->total_width*family->total_width, sizeof(double));
+
+    int b0 = qd->nborder_samples;
+    homography_project_n(quad->H->data, &qd->sample_x[b0], &qd->sample_y[b0], family->nbits,
+                         &sample_px[b0], &sample_py[b0]);
+
+    // with fixed-point sampling, check the bounding box of the samples
+    // once rather than every sample.
+    bool fixed_point = td->fixed_point_sampling && fixed_bilinear_supported(im);
+    bool fixed_inside = false;
+    if (fixed_point) {
+        double minx = HUGE_VAL, miny = HUGE_VAL, maxx = -HUGE_VAL, maxy = -HUGE_VAL;
+        for (uint32_t i = 0; i < family->nbits; i++) {
+            minx = fmin(minx, sample_px[b0 + i]);
+            maxx = fmax(maxx, sample_px[b0 + i]);
+            miny = fmin(miny, sample_py[b0 + i]);
+            maxy = fmax(maxy, sample_py[b0 + i]);
+        }
+        fixed_inside = fixed_bilinear_inside(im, fixed_from_double(minx - 0.5), fixed_from_double(miny - 0.5)) &&
+                       fixed_bilinear_inside(im, fixed_from_double(maxx - 0.5), fixed_from_double(maxy - 0.5));
+    }
 
-    int min_coord = (family->width_at_border - family->total_width)/2;
     for (uint32_t i = 0; i < family->nbits; i++) {
-        int bity = family->bit_y[i];
-        int bitx = family->bit_x[i];
-
-        double tagx01 = (bitx + 0.5) / (family->width_at_border);
-        double tagy01 = (bity + 0.5) / (family->width_at_border);
-
-        // scale to [-1, 1]
-        double tagx = 2*(tagx01-0.5);
-        double tagy = 2*(tagy01-0.5);
-
-        double px, py;
-        homography_project(quad->H, tagx, tagy, &px, &py);
-
-        double v = value_for_pixel(im, px, py);
+        double tagx = qd->sample_x[b0 + i];
+        double tagy = qd->sample_y[b0 + i];
+        double px = sample_px[b0 + i];
+        double py = sample_py[b0 + i];
+
+        double v;
+        if (fixed_point) {
+            int32_t fx = fixed_from_double(px - 0.5);
+            int32_t fy = fixed_from_double(py - 0.5);
+            if (!fixed_inside && !fixed_bilinear_inside(im, fx, fy))
+                continue;
+            v = fixed_bilinear(im, fx, fy) * (1.0 / 65536);
+        } else {
+            v = value_for_pixel(im, px, py);
+        }
 
         if (v == -1) {
             continue;
         }
 
         double thresh = (graymodel_interpolate(&blackmodel, tagx, tagy) + graymodel_interpolate(&whitemodel, tagx, tagy)) / 2.0;
-        values[family->total_width*(bity - min_coord) + bitx - min_coord] = v - thresh;
+        values[qd->sample_i[b0 + i]] = v - thresh;
 
         if (im_samples) {
             int ix = px;
@@ -717,14 +1575,12 @@ static float quad_decode(apriltag_detector_t* td, apriltag_family_t *family, ima
         }
     }
 
-    sharpen(td, values, family->total_width);
+    sharpen(td, values, family->total_width, arena);
 
     uint64_t rcode = 0;
     for (uint32_t i = 0; i < family->nbits; i++) {
-        int bity = family->bit_y[i];
-        int bitx = family->bit_x[i];
         rcode = (rcode << 1);
-        double v = values[(bity - min_coord)*family->total_width + bitx - min_coord];
+        double v = values[qd->sample_i[b0 + i]];
 
         if (v > 0) {
             white_score += v;
@@ -737,14 +1593,148 @@ static float quad_decode(apriltag_detector_t* td, apriltag_family_t *family, ima
     }
 
     quick_decode_codeword(family, rcode, entry);
-    free(values);
     return fmin(white_score / white_score_count, black_score / black_score_count);
 }
 
-static void refine_edges(apriltag_detector_t *td, image_u8_t *im_orig, struct quad *quad)
+// Samples im bilinearly at (x0 + t*nx - delta, y0 + t*ny - delta) for
+// t = (t0 + step_length*k) - grange and 0 <= k < n, into g[k]. ok[k]
+// is false where the sample was out of bounds.
+static void refine_edges_profile(const image_u8_t *im, double x0, double y0, double nx, double ny, double delta,
+                                 double t0, double step_length, double grange, int n, double *g, bool *ok)
+{
+    int k = 0;
+
+#ifdef APRILTAG_SSE2
+    // two samples at a time, with the same operations (and rounding)
+    // as the scalar loop below. _mm_cvttpd_epi32() truncates like
+    // modf(), and gives INT_MIN (so out of bounds) if out of range.
+    const __m128d one = _mm_set1_pd(1);
+    for (; k + 2 <= n; k += 2) {
+        __m128d t = _mm_set_pd((t0 + step_length*(k + 1)) - grange, (t0 + step_length*k) - grange);
+        __m128d x = _mm_sub_pd(_mm_add_pd(_mm_set1_pd(x0), _mm_mul_pd(t, _mm_set1_pd(nx))), _mm_set1_pd(delta));
+        __m128d y = _mm_sub_pd(_mm_add_pd(_mm_set1_pd(y0), _mm_mul_pd(t, _mm_set1_pd(ny))), _mm_set1_pd(delta));
+        __m128i xi = _mm_cvttpd_epi32(x);
+        __m128i yi = _mm_cvttpd_epi32(y);
+        __m128d a = _mm_sub_pd(x, _mm_cvtepi32_pd(xi));
+        __m128d b = _mm_sub_pd(y, _mm_cvtepi32_pd(yi));
+
+        int xi0 = _mm_cvtsi128_si32(xi), xi1 = _mm_cvtsi128_si32(_mm_srli_si128(xi, 4));
+        int yi0 = _mm_cvtsi128_si32(yi), yi1 = _mm_cvtsi128_si32(_mm_srli_si128(yi, 4));
+        ok[k] = xi0 >= 0 && xi0 + 1 < im->width && yi0 >= 0 && yi0 + 1 < im->height;
+        ok[k + 1] = xi1 >= 0 && xi1 + 1 < im->width && yi1 >= 0 && yi1 + 1 < im->height;
+        if (!ok[k] && !ok[k + 1])
+            continue;
+
+        // an out of bounds sample reads (and ignores) the first pixels.
+        const uint8_t *p0 = ok[k] ? &im->buf[yi0*im->stride + xi0] : im->buf;
+        const uint8_t *p1 = ok[k + 1] ? &im->buf[yi1*im->stride + xi1] : im->buf;
+        __m128d v00 = _mm_set_pd(p1[0], p0[0]);
+        __m128d v01 = _mm_set_pd(p1[1], p0[1]);
+        __m128d v10 = _mm_set_pd(p1[im->stride], p0[im->stride]);
+        __m128d v11 = _mm_set_pd(p1[im->stride + 1], p0[im->stride + 1]);
+
+        __m128d ia = _mm_sub_pd(one, a), ib = _mm_sub_pd(one, b);
+        __m128d v = _mm_mul_pd(_mm_mul_pd(ia, ib), v00);
+        v = _mm_add_pd(v, _mm_mul_pd(_mm_mul_pd(a, ib), v01));
+        v = _mm_add_pd(v, _mm_mul_pd(_mm_mul_pd(ia, b), v10));
+        v = _mm_add_pd(v, _mm_mul_pd(_mm_mul_pd(a, b), v11));
+        _mm_storeu_pd(&g[k], v);
+    }
+#endif
+
+    for (; k < n; k++) {
+        double t = (t0 + step_length*k) - grange;
+        double x = x0 + t*nx - delta;
+        double y = y0 + t*ny - delta;
+        double xi_d, yi_d, a, b;
+        a = modf(x, &xi_d);
+        b = modf(y, &yi_d);
+        int xi = xi_d, yi = yi_d;
+
+        ok[k] = xi >= 0 && xi + 1 < im->width && yi >= 0 && yi + 1 < im->height;
+        if (!ok[k])
+            continue;
+
+        const uint8_t *p = &im->buf[yi*im->stride + xi];
+        g[k] = (1 - a) * (1 - b) * p[0] +
+                     a * (1 - b) * p[1] +
+               (1 - a) *    b    * p[im->stride] +
+                     a *    b    * p[im->stride + 1];
+    }
+}
+
+// The same with fixed_bilinear() at (fx + k*fdx, fy + k*fdy). If
+// inside, every sample is known to be in bounds.
+static void refine_edges_profile_fixed(const image_u8_t *im, int32_t fx, int32_t fy, int32_t fdx, int32_t fdy,
+                                       bool inside, int n, double *g, bool *ok)
+{
+    for (int k = 0; k < n; k++) {
+        int32_t sx = fx + k*fdx, sy = fy + k*fdy;
+        ok[k] = inside || fixed_bilinear_inside(im, sx, sy);
+        if (ok[k])
+            g[k] = fixed_bilinear(im, sx, sy) * (1.0 / 65536);
+    }
+}
+
+static void refine_edges(apriltag_detector_t *td, image_u8_t *im_orig, struct quad *quad, arena_t *arena)
 {
     double lines[4][4]; // for each line, [Ex Ey nx ny]
 
+    // XXX tunable: how far to search?  We want to search far enough
+    // that we find the best edge, but not so far that we hit other
+    // edges that aren't part of the tag. We shouldn't ever have to
+    // search more than quad_decimate, since otherwise we would
+    // (ideally) have started our search on another pixel in the first
+    // place. Likewise, for very small tags, we don't want the range to
+    // be too big.
+    int range = td->quad_decimate + 1;
+
+    // sample to points (x1,y1) and (x2,y2) XXX tunable: how far +/- to
+    // look? Small values compute the gradient more precisely, but are
+    // more sensitive to noise.
+    double grange = 1;
+
+    // To reduce the overhead of bilinear interpolation, we can
+    // reduce the number of steps per unit.
+    int steps_per_unit = 4;
+    double step_length = 1.0 / steps_per_unit;
+    int max_steps = 2 * steps_per_unit * range + 1;
+    double delta = 0.5;
+
+    // each step samples at n + grange and n - grange along the normal,
+    // which are the same points shift steps apart. So the profile along
+    // the normal is sampled once, at every n - grange, for all steps.
+    int shift = 2 * grange * steps_per_unit;
+    int nprofile = max_steps + shift;
+    double *profile = arena_alloc(arena, sizeof(double)*nprofile);
+    bool *profile_ok = arena_alloc(arena, sizeof(bool)*nprofile);
+
+    // with fixed-point sampling, bounds checks are only needed if some
+    // sample might be outside the image. Every sample is within
+    // range + grange of the quad's edges.
+    bool fixed_point = td->fixed_point_sampling && fixed_bilinear_supported(im_orig);
+    bool fixed_inside = false;
+    if (fixed_point) {
+        double margin = range + grange + 1.0 / 64;
+        double minx = HUGE_VAL, miny = HUGE_VAL, maxx = -HUGE_VAL, maxy = -HUGE_VAL;
+        for (int i = 0; i < 4; i++) {
+            minx = fmin(minx, quad->p[i][0]);
+            maxx = fmax(maxx, quad->p[i][0]);
+            miny = fmin(miny, quad->p[i][1]);
+            maxy = fmax(maxy, quad->p[i][1]);
+        }
+        minx -= margin + 0.5;
+        miny -= margin + 0.5;
+        maxx += margin - 0.5;
+        maxy += margin - 0.5;
+
+        // keep the fixed-point arithmetic well away from overflow.
+        fixed_point = fabs(minx) < 16384 && fabs(maxx) < 16384 && fabs(miny) < 16384 && fabs(maxy) < 16384;
+        fixed_inside = fixed_point &&
+                       fixed_bilinear_inside(im_orig, fixed_from_double(minx), fixed_from_double(miny)) &&
+                       fixed_bilinear_inside(im_orig, fixed_from_double(maxx), fixed_from_double(maxy));
+    }
+
     for (int edge = 0; edge < 4; edge++) {
         int a = edge, b = (edge + 1) & 3; // indices of the end points.
 
@@ -760,6 +1750,17 @@ static void refine_edges(apriltag_detector_t *td, image_u8_t *im_orig, struct qu
             ny = -ny;
         }
 
+        // keep the line of an edge that was already fit well enough
+        // (the mse of a perfectly straight edge can come out slightly
+        // negative, so a threshold of 0 must not compare with it).
+        if (td->refine_edges_skip_mse > 0 && quad->line_mse[edge] < td->refine_edges_skip_mse) {
+            lines[edge][0] = (quad->p[a][0] + quad->p[b][0]) / 2;
+            lines[edge][1] = (quad->p[a][1] + quad->p[b][1]) / 2;
+            lines[edge][2] = nx;
+            lines[edge][3] = ny;
+            continue;
+        }
+
         // we will now fit a NEW line by sampling points near
         // our original line that have large gradients. On really big tags,
         // we're willing to sample more to get an even better estimate.
@@ -782,66 +1783,28 @@ static void refine_edges(apriltag_detector_t *td, image_u8_t *im_orig, struct qu
             double Mn = 0;
             double Mcount = 0;
 
-            // XXX tunable: how far to search?  We want to search far
-            // enough that we find the best edge, but not so far that
-            // we hit other edges that aren't part of the tag. We
-            // shouldn't ever have to search more than quad_decimate,
-            // since otherwise we would (ideally) have started our
-            // search on another pixel in the first place. Likewise,
-            // for very small tags, we don't want the range to be too
-            // big.
-
-            int range = td->quad_decimate + 1;
-
-            // To reduce the overhead of bilinear interpolation, we can
-            // reduce the number of steps per unit.
-            int steps_per_unit = 4;
-            double step_length = 1.0 / steps_per_unit;
-            int max_steps = 2 * steps_per_unit * range + 1;
-            double delta = 0.5;
+            if (fixed_point) {
+                refine_edges_profile_fixed(im_orig,
+                                           fixed_from_double(x0 + (-range - grange)*nx - delta),
+                                           fixed_from_double(y0 + (-range - grange)*ny - delta),
+                                           fixed_from_double(step_length*nx), fixed_from_double(step_length*ny),
+                                           fixed_inside, nprofile, profile, profile_ok);
+            } else {
+                refine_edges_profile(im_orig, x0, y0, nx, ny, delta, -range, step_length, grange,
+                                     nprofile, profile, profile_ok);
+            }
 
             // XXX tunable step size.
             for (int step = 0; step < max_steps; ++step) {
-                double n = -range + step_length * step;
                 // Because of the guaranteed winding order of the
                 // points in the quad, we will start inside the white
                 // portion of the quad and work our way outward.
-                //
-                // sample to points (x1,y1) and (x2,y2) XXX tunable:
-                // how far +/- to look? Small values compute the
-                // gradient more precisely, but are more sensitive to
-                // noise.
-                double grange = 1;
-
-                double x1 = x0 + (n + grange)*nx - delta;
-                double y1 = y0 + (n + grange)*ny - delta;
-                double x1i_d, y1i_d, a1, b1;
-                a1 = modf(x1, &x1i_d);
-                b1 = modf(y1, &y1i_d);
-                int x1i = x1i_d, y1i = y1i_d;
-
-                if (x1i < 0 || x1i + 1 >= im_orig->width || y1i < 0 || y1i + 1 >= im_orig->height)
+                if (!profile_ok[step + shift] || !profile_ok[step])
                     continue;
 
-                double x2 = x0 + (n - grange)*nx - delta;
-                double y2 = y0 + (n - grange)*ny - delta;
-                double x2i_d, y2i_d, a2, b2;
-                a2 = modf(x2, &x2i_d);
-                b2 = modf(y2, &y2i_d);
-                int x2i = x2i_d, y2i = y2i_d;
-
-                if (x2i < 0 || x2i + 1 >= im_orig->width || y2i < 0 || y2i + 1 >= im_orig->height)
-                    continue;
-
-                // interpolate
-                double g1 = (1 - a1) * (1 - b1) * im_orig->buf[y1i*im_orig->stride + x1i] +
-                                  a1 * (1 - b1) * im_orig->buf[y1i*im_orig->stride + x1i + 1] +
-                            (1 - a1) *    b1    * im_orig->buf[(y1i + 1)*im_orig->stride + x1i] +
-                                  a1 *    b1    * im_orig->buf[(y1i + 1)*im_orig->stride + x1i + 1];
-                double g2 = (1 - a2) * (1 - b2) * im_orig->buf[y2i*im_orig->stride + x2i] +
-                                  a2 * (1 - b2) * im_orig->buf[y2i*im_orig->stride + x2i + 1] +
-                            (1 - a2) *    b2    * im_orig->buf[(y2i + 1)*im_orig->stride + x2i] +
-                                  a2 *    b2    * im_orig->buf[(y2i + 1)*im_orig->stride + x2i + 1];
+                double n = -range + step_length * step;
+                double g1 = profile[step + shift];
+                double g2 = profile[step];
                 if (g1 < g2) // reject points whose gradient is "backwards". They can only hurt us.
                     continue;
 
@@ -922,6 +1885,8 @@ static void quad_decode_task(void *_u)
     apriltag_detector_t *td = task->td;
     image_u8_t *im = task->im;
 
+    arena_t *arena = apriltag_detector_borrow_arena(td);
+
     for (int quadidx = task->i0; quadidx < task->i1; quadidx++) {
         struct quad *quad_original;
         zarray_get_volatile(task->quads, quadidx, &quad_original);
@@ -930,7 +1895,7 @@ static void quad_decode_task(void *_u)
         // apply this optimization BEFORE the other work.
         //if (td->quad_decimate > 1 && td->refine_edges) {
         if (td->refine_edges) {
-            refine_edges(td, im, quad_original);
+            refine_edges(td, im, quad_original, arena);
         }
 
         // make sure the homographies are computed...
@@ -945,63 +1910,65 @@ static void quad_decode_task(void *_u)
                 continue;
             }
 
-            // since the geometry of tag families can vary, start any
-            // optimization process over with the original quad.
-            struct quad *quad = quad_copy(quad_original);
+            // quad_decode() does not modify the quad, so every family
+            // can start from the original.
+            struct quad *quad = quad_original;
 
             struct quick_decode_entry entry;
 
-            float decision_margin = quad_decode(td, family, im, quad, &entry, task->im_samples);
+            float decision_margin = quad_decode(td, family, im, quad, &entry, task->im_samples, arena);
+            arena_reset(arena);
 
             if (decision_margin >= 0 && entry.hamming < 255) {
-                apriltag_detection_t *det = calloc(1, sizeof(apriltag_detection_t));
+                apriltag_detection_result_t det;
 
-                det->family = family;
-                det->id = entry.id;
-                det->hamming = entry.hamming;
-                det->decision_margin = decision_margin;
+                det.family = family;
+                det.family_idx = famidx;
+                det.id = entry.id;
+                det.hamming = entry.hamming;
+                det.decision_margin = decision_margin;
 
                 double theta = entry.rotation * M_PI / 2.0;
                 double c = cos(theta), s = sin(theta);
 
                 // Fix the rotation of our homography to properly orient the tag
-                matd_t *R = matd_create(3,3);
-                MATD_EL(R, 0, 0) = c;
-                MATD_EL(R, 0, 1) = -s;
-                MATD_EL(R, 1, 0) = s;
-                MATD_EL(R, 1, 1) = c;
-                MATD_EL(R, 2, 2) = 1;
-
-                det->H = matd_op("M*M", quad->H, R);
-
-                matd_destroy(R);
-
-                homography_project(det->H, 0, 0, &det->c[0], &det->c[1]);
+                double R[9] = { c, -s, 0,
+                                s,  c, 0,
+                                0,  0, 1 };
+
+                for (int i = 0; i < 3; i++) {
+                    for (int j = 0; j < 3; j++) {
+                        double acc = 0;
+                        for (int k = 0; k < 3; k++)
+                            acc += MATD_EL(quad->H, i, k) * R[3*k + j];
+                        det.H[3*i + j] = acc;
+                    }
+                }
 
+                // the center, then the corners.
                 // [-1, -1], [1, -1], [1, 1], [-1, 1], Desired points
                 // [-1, 1], [1, 1], [1, -1], [-1, -1], FLIP Y
                 // adjust the points in det->p so that they correspond to
                 // counter-clockwise around the quad, starting at -1,-1.
-                for (int i = 0; i < 4; i++) {
-                    int tcx = (i == 1 || i == 2) ? 1 : -1;
-                    int tcy = (i < 2) ? 1 : -1;
+                static const double tx[5] = { 0, -1, 1,  1, -1 };
+                static const double ty[5] = { 0,  1, 1, -1, -1 };
+                double px[5], py[5];
 
-                    double p[2];
+                homography_project_n(det.H, tx, ty, 5, px, py);
 
-                    homography_project(det->H, tcx, tcy, &p[0], &p[1]);
-
-                    det->p[i][0] = p[0];
-                    det->p[i][1] = p[1];
+                det.c[0] = px[0];
+                det.c[1] = py[0];
+                for (int i = 0; i < 4; i++) {
+                    det.p[i][0] = px[i + 1];
+                    det.p[i][1] = py[i + 1];
                 }
 
-                pthread_mutex_lock(&td->mutex);
-                zarray_add(task->detections, &det);
-                pthread_mutex_unlock(&td->mutex);
+                task->results[task->nresults++] = det;
             }
-
-            quad_destroy(quad);
         }
     }
+
+    apriltag_detector_return_arena(td, arena);
 }
 
 void apriltag_detection_destroy(apriltag_detection_t *det)
@@ -1027,24 +1994,55 @@ static int prefer_smaller(int pref, double q0, double q1)
     return 0;
 }
 
-zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
+// Only detections of the same tag can be reconciled with each other, so
+// detections are grouped by family and id, in their original order
+// within each group.
+struct reconcile_entry
+{
+    const apriltag_family_t *family;
+    int id;
+    int index;
+
+    // the bounding box of the corners
+    double xmin, ymin, xmax, ymax;
+};
+
+static int reconcile_entry_compare(const void *_a, const void *_b)
 {
+    const struct reconcile_entry *a = (const struct reconcile_entry*) _a;
+    const struct reconcile_entry *b = (const struct reconcile_entry*) _b;
+
+    if (a->family != b->family)
+        return (uintptr_t) a->family < (uintptr_t) b->family ? -1 : 1;
+    if (a->id != b->id)
+        return a->id < b->id ? -1 : 1;
+    return a->index - b->index;
+}
+
+// Runs the detector, leaving the detections in td->results. Returns
+// false if no detection could be attempted.
+static bool detect(apriltag_detector_t *td, image_u8_t *im_orig)
+{
+    zarray_clear(td->results);
+
     if (zarray_size(td->tag_families) == 0) {
-        zarray_t *s = zarray_create(sizeof(apriltag_detection_t*));
         debug_print("No tag families enabled\n");
-        return s;
+        return false;
     }
 
     if (td->wp == NULL || td->nthreads != workerpool_get_nthreads(td->wp)) {
         workerpool_destroy(td->wp);
         td->wp = workerpool_create(td->nthreads);
         if (td->wp == NULL) {
-            // creating workerpool failed - return empty zarray
-            return zarray_create(sizeof(apriltag_detection_t*));
+            // creating workerpool failed
+            return false;
         }
     }
 
     timeprofile_clear(td->tp);
+
+    arena_reset(td->frame_arena);
+
     timeprofile_stamp(td->tp, "init");
 
     ///////////////////////////////////////////////////////////
@@ -1119,6 +2117,7 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
             for (int j = 0; j < 4; j++) {
                 q->p[j][0] *= td->quad_decimate;
                 q->p[j][1] *= td->quad_decimate;
+                q->line_mse[j] *= td->quad_decimate * td->quad_decimate;
             }
         }
     }
@@ -1126,7 +2125,7 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
     if (quad_im != im_orig)
         image_u8_destroy(quad_im);
 
-    zarray_t *detections = zarray_create(sizeof(apriltag_detection_t*));
+    zarray_t *detections = td->results;
 
     td->nquads = zarray_size(quads);
 
@@ -1163,7 +2162,14 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
 
         int chunksize = 1 + zarray_size(quads) / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
 
-        struct quad_decode_task *tasks = malloc(sizeof(struct quad_decode_task)*(zarray_size(quads) / chunksize + 1));
+        struct quad_decode_task *tasks = arena_alloc(td->frame_arena, sizeof(struct quad_decode_task)*(zarray_size(quads) / chunksize + 1));
+
+        // each task writes its detections to its own part of
+        // results, without locking, and they are concatenated in task
+        // (so quad) order.
+        int nfamilies = zarray_size(td->tag_families);
+        apriltag_detection_result_t *results =
+            arena_alloc(td->frame_arena, sizeof(apriltag_detection_result_t)*zarray_size(quads)*nfamilies);
 
         int ntasks = 0;
         for (int i = 0; i < zarray_size(quads); i+= chunksize) {
@@ -1172,7 +2178,8 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
             tasks[ntasks].quads = quads;
             tasks[ntasks].td = td;
             tasks[ntasks].im = im_orig;
-            tasks[ntasks].detections = detections;
+            tasks[ntasks].results = &results[i*nfamilies];
+            tasks[ntasks].nresults = 0;
 
             tasks[ntasks].im_samples = im_samples;
 
@@ -1182,7 +2189,10 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
 
         workerpool_run(td->wp);
 
-        free(tasks);
+        for (int i = 0; i < ntasks; i++) {
+            for (int j = 0; j < tasks[i].nresults; j++)
+                zarray_add(detections, &tasks[i].results[j]);
+        }
 
         if (im_samples != NULL) {
             image_u8_write_pnm(im_samples, "debug_samples.pnm");
@@ -1220,30 +2230,74 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
     ////////////////////////////////////////////////////////////////
     // Step 3. Reconcile detections--- don't report the same tag more
     // than once. (Allow non-overlapping duplicate detections.)
+    //
+    // Detections are compared pairwise within each group of the same
+    // family and id, in their original order, exactly as if every pair
+    // of detections were compared. Pairs whose bounding boxes don't
+    // meet can't overlap and skip the exact test. The survivors are
+    // then compacted in one pass.
     if (1) {
         zarray_t *poly0 = g2d_polygon_create_zeros(4);
         zarray_t *poly1 = g2d_polygon_create_zeros(4);
 
-        for (int i0 = 0; i0 < zarray_size(detections); i0++) {
-
-            apriltag_detection_t *det0;
-            zarray_get(detections, i0, &det0);
-
-            for (int k = 0; k < 4; k++)
-                zarray_set(poly0, k, det0->p[k], NULL);
+        int ndetections = zarray_size(detections);
+        struct reconcile_entry *entries = arena_alloc(td->frame_arena, sizeof(struct reconcile_entry)*ndetections);
+        bool *dropped = arena_calloc(td->frame_arena, ndetections, sizeof(bool));
+
+        for (int i = 0; i < ndetections; i++) {
+            apriltag_detection_result_t *det;
+            zarray_get_volatile(detections, i, &det);
+
+            struct reconcile_entry *entry = &entries[i];
+            entry->family = det->family;
+            entry->id = det->id;
+            entry->index = i;
+            entry->xmin = entry->xmax = det->p[0][0];
+            entry->ymin = entry->ymax = det->p[0][1];
+            for (int k = 1; k < 4; k++) {
+                entry->xmin = fmin(entry->xmin, det->p[k][0]);
+                entry->xmax = fmax(entry->xmax, det->p[k][0]);
+                entry->ymin = fmin(entry->ymin, det->p[k][1]);
+                entry->ymax = fmax(entry->ymax, det->p[k][1]);
+            }
+        }
 
-            for (int i1 = i0+1; i1 < zarray_size(detections); i1++) {
+        if (ndetections > 1)
+            qsort(entries, ndetections, sizeof(struct reconcile_entry), reconcile_entry_compare);
 
-                apriltag_detection_t *det1;
-                zarray_get(detections, i1, &det1);
+        for (int g0 = 0, g1; g0 < ndetections; g0 = g1) {
+            g1 = g0 + 1;
+            while (g1 < ndetections && entries[g1].family == entries[g0].family && entries[g1].id == entries[g0].id)
+                g1++;
 
-                if (det0->id != det1->id || det0->family != det1->family)
+            for (int j0 = g0; j0 < g1; j0++) {
+                struct reconcile_entry *e0 = &entries[j0];
+                if (dropped[e0->index])
                     continue;
 
+                apriltag_detection_result_t *det0;
+                zarray_get_volatile(detections, e0->index, &det0);
+
                 for (int k = 0; k < 4; k++)
-                    zarray_set(poly1, k, det1->p[k], NULL);
+                    zarray_set(poly0, k, det0->p[k], NULL);
+
+                for (int j1 = j0 + 1; j1 < g1; j1++) {
+                    struct reconcile_entry *e1 = &entries[j1];
+                    if (dropped[e1->index])
+                        continue;
+
+                    if (e1->xmin > e0->xmax || e1->xmax < e0->xmin || e1->ymin > e0->ymax || e1->ymax < e0->ymin)
+                        continue;
+
+                    apriltag_detection_result_t *det1;
+                    zarray_get_volatile(detections, e1->index, &det1);
+
+                    for (int k = 0; k < 4; k++)
+                        zarray_set(poly1, k, det1->p[k], NULL);
+
+                    if (!g2d_polygon_overlaps_polygon(poly0, poly1))
+                        continue;
 
-                if (g2d_polygon_overlaps_polygon(poly0, poly1)) {
                     // the tags overlap. Delete one, keep the other.
 
                     int pref = 0; // 0 means undecided which one we'll keep.
@@ -1264,25 +2318,31 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
                     }
 
                     if (pref < 0) {
-                        // keep det0, destroy det1
-                        apriltag_detection_destroy(det1);
-                        zarray_remove_index(detections, i1, 1);
-                        i1--; // retry the same index
-                        goto retry1;
+                        // keep det0, drop det1
+                        dropped[e1->index] = true;
                     } else {
-                        // keep det1, destroy det0
-                        apriltag_detection_destroy(det0);
-                        zarray_remove_index(detections, i0, 1);
-                        i0--; // retry the same index.
-                        goto retry0;
+                        // keep det1, drop det0
+                        dropped[e0->index] = true;
+                        break;
                     }
                 }
-
-              retry1: ;
             }
+        }
+
+        int nkept = 0;
+        for (int i = 0; i < ndetections; i++) {
+            if (dropped[i])
+                continue;
 
-          retry0: ;
+            if (nkept != i) {
+                apriltag_detection_result_t *det;
+                zarray_get_volatile(detections, i, &det);
+                zarray_set(detections, nkept, det, NULL);
+            }
+            nkept++;
         }
+        while (zarray_size(detections) > nkept)
+            zarray_remove_index(detections, zarray_size(detections) - 1, 0);
 
         zarray_destroy(poly0);
         zarray_destroy(poly1);
@@ -1310,8 +2370,8 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
         image_u8_destroy(darker);
 
         for (int i = 0; i < zarray_size(detections); i++) {
-            apriltag_detection_t *det;
-            zarray_get(detections, i, &det);
+            apriltag_detection_result_t *det;
+            zarray_get_volatile(detections, i, &det);
 
             float rgb[3];
             int bias = 100;
@@ -1350,8 +2410,8 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
         image_u8_destroy(darker);
 
         for (int i = 0; i < zarray_size(detections); i++) {
-            apriltag_detection_t *det;
-            zarray_get(detections, i, &det);
+            apriltag_detection_result_t *det;
+            zarray_get_volatile(detections, i, &det);
 
             float rgb[3];
             int bias = 100;
@@ -1427,11 +2487,61 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
     zarray_destroy(quads);
 
     zarray_sort(detections, detection_compare_function);
+
+    td->frame_scratch_high_water = arena_high_water(td->frame_arena);
+    td->worker_scratch_high_water = 0;
+    for (int i = 0; i < zarray_size(td->worker_arenas); i++) {
+        arena_t *arena;
+        zarray_get(td->worker_arenas, i, &arena);
+        if (arena_high_water(arena) > td->worker_scratch_high_water)
+            td->worker_scratch_high_water = arena_high_water(arena);
+    }
+
     timeprofile_stamp(td->tp, "cleanup");
 
+    return true;
+}
+
+zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
+{
+    zarray_t *detections = zarray_create(sizeof(apriltag_detection_t*));
+
+    if (!detect(td, im_orig))
+        return detections;
+
+    zarray_ensure_capacity(detections, zarray_size(td->results));
+    for (int i = 0; i < zarray_size(td->results); i++) {
+        apriltag_detection_result_t *res;
+        zarray_get_volatile(td->results, i, &res);
+
+        apriltag_detection_t *det = calloc(1, sizeof(apriltag_detection_t));
+        det->family = res->family;
+        det->id = res->id;
+        det->hamming = res->hamming;
+        det->decision_margin = res->decision_margin;
+        det->H = matd_create_data(3, 3, res->H);
+        memcpy(det->c, res->c, sizeof(det->c));
+        memcpy(det->p, res->p, sizeof(det->p));
+
+        zarray_add(detections, &det);
+    }
+
     return detections;
 }
 
+int apriltag_detector_detect_into(apriltag_detector_t *td, image_u8_t *im_orig,
+                                  apriltag_detection_result_t *dets, int capacity)
+{
+    if (!detect(td, im_orig))
+        return 0;
+
+    int n = zarray_size(td->results);
+    if (n > 0 && capacity > 0)
+        memcpy(dets, td->results->data, sizeof(apriltag_detection_result_t)*imin(n, capacity));
+
+    return n;
+}
+
 
 // Call this method on each of the tags returned by apriltag_detector_detect
 void apriltag_detections_destroy(zarray_t *detections)
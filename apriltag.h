@@ -36,6 +36,7 @@ extern "C" {
 #include "common/matd.h"
 #include "common/image_u8.h"
 #include "common/zarray.h"
+#include "common/arena.h"
 #include "common/workerpool.h"
 #include "common/timeprofile.h"
 #include "common/pthreads_cross.h"
@@ -48,6 +49,10 @@ struct quad
 
     bool reversed_border;
 
+    // the mean squared error of the line fit to each edge, from p[i]
+    // to p[(i+1)&3], in squared pixels.
+    float line_mse[4];
+
     // H: tag coordinates ([-1,1] at the black corners) to pixels
     // Hinv: pixels to tag
     matd_t *H, *Hinv;
@@ -83,7 +88,9 @@ struct apriltag_family
 
     // some detector implementations may preprocess codes in order to
     // accelerate decoding.  They put their data here. (Do not use the
-    // same apriltag_family instance in more than one implementation)
+    // same apriltag_family instance in more than one implementation.
+    // It can be shared by any number of apriltag detectors, which
+    // share the data.)
     void *impl;
 };
 
@@ -118,6 +125,46 @@ struct apriltag_quad_thresh_params
     // should the thresholded image be deglitched? Only useful for
     // very noisy images
     int deglitch;
+
+    // should the tile statistics and the binarization be computed in
+    // a single streaming pass over horizontal bands of the image?
+    // Each band keeps only a three-row window of tile statistics, so
+    // the full-size min/max planes are never written out. The
+    // thresholded image is identical either way.
+    int fused_threshold;
+
+    // should the thresholded image be stored as two bitplanes (one
+    // bit for "binarized", one for black/white) rather than one byte
+    // per pixel? This cuts its memory footprint 4x and lets the
+    // connected components and gradient clustering steps skip over
+    // uniform areas a 64-bit word at a time. The detections are
+    // identical either way.
+    int packed_threshold;
+
+    // should connected components be computed over horizontal runs of
+    // equal pixels rather than over individual pixels? The union-find
+    // then has one entry per run instead of 8 bytes per pixel, and
+    // only runs in adjacent rows need to be connected. The components
+    // are identical either way (clusters and quads may come out in a
+    // different order).
+    int run_length_components;
+
+    // should the gradient clusters be built by counting-sorting one
+    // flat array of (cluster, point) records per thread into a single
+    // array, rather than with a hash map of growable arrays per
+    // cluster? This avoids allocating every cluster separately and
+    // merging the clusters of different threads serially, at the cost
+    // of moving every point once more. The points of each cluster are
+    // the same, in the same order, either way (the clusters come out
+    // in a different order).
+    int sorted_clusters;
+
+    // should the points that one boundary pixel adds to a cluster be
+    // merged into one? A pixel usually borders the other side of the
+    // edge in two or three directions, and each adds a point, so this
+    // roughly halves the size of the clusters and the cost of fitting
+    // quads to them. The quads shift slightly.
+    int merge_cluster_points;
 };
 
 // Represents a detector object. Upon creating a detector, all fields
@@ -153,6 +200,13 @@ struct apriltag_detector
     // quad_decimate = 1.
     bool refine_edges;
 
+    // Edges whose initial line fit has a mean squared error (in squared
+    // pixels) below this aren't refined, which saves most of the
+    // refinement work on large, sharp tags at some cost in accuracy.
+    //
+    // The default value is 0, which refines every edge.
+    double refine_edges_skip_mse;
+
     // How much sharpening should be done to decoded images? This
     // can help decode small tags but may or may not help in odd
     // lighting conditions or low light conditions.
@@ -160,6 +214,32 @@ struct apriltag_detector
     // The default value is 0.25.
     double decode_sharpening;
 
+    // When true, quad decoding and edge refinement interpolate pixels
+    // in fixed point, with 8-bit sub-pixel weights, rather than in
+    // double precision. This is faster and moves the corners by a few
+    // thousandths of a pixel at most.
+    //
+    // The default value is false.
+    bool fixed_point_sampling;
+
+    // The largest table (in bytes) that apriltag_detector_add_family_bits()
+    // will precompute of every code within the requested number of bit
+    // errors. Bigger families (e.g. tagCircle49h12 or
+    // tagStandard52h13 with 2 or more bits corrected, which would need
+    // several GB) are decoded with a multi-index hash instead, whose
+    // memory is linear in the number of codes but which does a little
+    // more work per quad. Only affects families added afterwards.
+    //
+    // The default value is 256 MB. Zero always uses the multi-index hash.
+    size_t max_decode_table_bytes;
+
+    // When true, apriltag_detector_add_family_bits() only tabulates
+    // the codes within one bit error before returning, which takes
+    // milliseconds, and the rest (for 2 or more bits corrected) on a
+    // background thread. Until that is done, tags with more errors
+    // aren't decoded. Only affects families added afterwards.
+    bool lazy_decode_tables;
+
     // When true, write a variety of debugging images to the
     // current working directory at various stages through the
     // detection process. (Somewhat slow).
@@ -175,6 +255,18 @@ struct apriltag_detector
     uint32_t nsegments;
     uint32_t nquads;
 
+    // the clusters that quads were fit to, and their total number of
+    // points.
+    uint32_t nclusters;
+    uint32_t ncluster_points;
+
+    // The most memory the scratch arenas have needed at once since the
+    // detector was created: the calling thread's arena, and the
+    // largest of the worker threads' arenas. See
+    // apriltag_detector_reserve_scratch().
+    size_t frame_scratch_high_water;
+    size_t worker_scratch_high_water;
+
     ///////////////////////////////////////////////////////////////
     // Internal variables below
 
@@ -186,6 +278,19 @@ struct apriltag_detector
     // Used to manage multi-threading.
     workerpool_t *wp;
 
+    // apriltag_detection_result_t. The detections of the last frame,
+    // which the detect functions copy out.
+    zarray_t *results;
+
+    // Transient buffers come from these arenas rather than the
+    // heap. frame_arena belongs to the calling thread and is reset at
+    // the start of each frame; each worker task borrows one of
+    // worker_arenas (all of them, in use or not) from free_arenas for
+    // its duration, so there are no more of them than threads.
+    arena_t *frame_arena;
+    zarray_t *worker_arenas;
+    zarray_t *free_arenas;
+
     // Used for thread safety.
     pthread_mutex_t mutex;
 };
@@ -230,11 +335,37 @@ struct apriltag_detection
     double p[4][2];
 };
 
+// A detection as written by apriltag_detector_detect_into(). The
+// fields are the same as in apriltag_detection_t, except that H is
+// stored inline (row-major), so there is nothing to free.
+typedef struct apriltag_detection_result apriltag_detection_result_t;
+struct apriltag_detection_result
+{
+    // a pointer for convenience, and the family's index among those
+    // added to the detector.
+    apriltag_family_t *family;
+    int family_idx;
+
+    int id;
+    int hamming;
+    float decision_margin;
+
+    double H[9];
+
+    double c[2];
+    double p[4][2];
+};
+
 // don't forget to add a family!
 apriltag_detector_t *apriltag_detector_create();
 
 // add a family to the apriltag detector. caller still "owns" the family.
-// a single instance should only be provided to one apriltag detector instance.
+// The same instance can be added to any number of detectors (also on
+// different threads), which then share a single read-only decoder,
+// built by the first one to add it with the bits_corrected it asked
+// for. The decoder is freed once every detector has removed the
+// family. If the decoder can't be built, errno is set and the family
+// isn't added.
 void apriltag_detector_add_family_bits(apriltag_detector_t *td, apriltag_family_t *fam, int bits_corrected);
 
 // Tunable, but really, 2 is a good choice. Values of >=3
@@ -245,12 +376,40 @@ static inline void apriltag_detector_add_family(apriltag_detector_t *td, aprilta
     apriltag_detector_add_family_bits(td, fam, 2);
 }
 
+// Building the table that apriltag_detector_add_family_bits() uses to
+// correct bit errors can take seconds for the bigger families. Instead
+// it can be saved to a file once, e.g. with the apriltag_decode_table
+// tool, and then mapped read-only when the family is added, which is
+// nearly instant and lets every process on a host share the same
+// pages. The file is only usable on machines with the same byte order.
+//
+// Writes the table of fam with bits_corrected to path, however big
+// it is (ignoring max_decode_table_bytes). Returns 0 on success, or -1
+// with errno set on failure.
+int apriltag_family_save_decode_table(apriltag_family_t *fam, int bits_corrected, const char *path);
+
+// Like apriltag_detector_add_family_bits(), but maps the table from a
+// file written by apriltag_family_save_decode_table(). Returns 0 on
+// success, or -1 with errno set (to EINVAL if the file holds a table
+// for a different family, bits_corrected or version) without adding
+// the family. The file must not be modified while the family is in
+// use.
+int apriltag_detector_add_family_bits_mapped(apriltag_detector_t *td, apriltag_family_t *fam, int bits_corrected,
+                                             const char *path);
+
 // does not deallocate the family.
 void apriltag_detector_remove_family(apriltag_detector_t *td, apriltag_family_t *fam);
 
 // unregister all families, but does not deallocate the underlying tag family objects.
 void apriltag_detector_clear_families(apriltag_detector_t *td);
 
+// The scratch arenas grow as needed during the first frames, after
+// which they are reused without allocating. To avoid that warm-up
+// (e.g. on a real-time target), size them up front from the
+// frame_scratch_high_water and worker_scratch_high_water stats of a
+// representative run. Call after setting nthreads.
+void apriltag_detector_reserve_scratch(apriltag_detector_t *td, size_t frame_bytes, size_t worker_bytes);
+
 // Destroy the april tag detector (but not the underlying
 // apriltag_family_t used to initialize it.)
 void apriltag_detector_destroy(apriltag_detector_t *td);
@@ -261,6 +420,14 @@ void apriltag_detector_destroy(apriltag_detector_t *td);
 // _detection_destroy and zarray_destroy yourself.
 zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig);
 
+// Like apriltag_detector_detect(), but writes the detections to dets,
+// which has room for capacity of them, and allocates nothing for the
+// results. Returns the number of detections; if that is more than
+// capacity, only the first capacity (in the same order as
+// apriltag_detector_detect() would return them) were written.
+int apriltag_detector_detect_into(apriltag_detector_t *td, image_u8_t *im_orig,
+                                  apriltag_detection_result_t *dets, int capacity);
+
 // Call this method on each of the tags returned by apriltag_detector_detect
 void apriltag_detection_destroy(apriltag_detection_t *det);
 
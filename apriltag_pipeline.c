@@ -0,0 +1,215 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "apriltag_pipeline.h"
+#include "common/pthreads_cross.h"
+#include "common/debug_print.h"
+
+// A detector and the thread that runs it, which takes every depth'th
+// frame.
+struct pipeline_slot
+{
+    apriltag_pipeline_t *pl;
+    apriltag_detector_t *td;
+    pthread_t thread;
+    bool started;
+
+    // the frame being processed, if busy. Guarded by pl->mutex.
+    bool busy;
+    image_u8_t *im;
+    uint64_t frame;
+};
+
+struct apriltag_pipeline
+{
+    int depth;
+    struct pipeline_slot *slots;
+
+    apriltag_pipeline_callback_t callback;
+    void *user;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;    // broadcast on every change below
+
+    uint64_t nsubmitted;    // frames submitted so far
+    uint64_t ndelivered;    // frames whose callback has returned
+    bool stop;
+};
+
+static void *pipeline_thread(void *p)
+{
+    struct pipeline_slot *slot = (struct pipeline_slot*) p;
+    apriltag_pipeline_t *pl = slot->pl;
+
+    pthread_mutex_lock(&pl->mutex);
+    while (1) {
+        while (!slot->busy && !pl->stop)
+            pthread_cond_wait(&pl->cond, &pl->mutex);
+
+        if (!slot->busy)
+            break;
+
+        image_u8_t *im = slot->im;
+        uint64_t frame = slot->frame;
+        pthread_mutex_unlock(&pl->mutex);
+
+        zarray_t *detections = apriltag_detector_detect(slot->td, im);
+
+        // deliver in order.
+        pthread_mutex_lock(&pl->mutex);
+        while (pl->ndelivered != frame)
+            pthread_cond_wait(&pl->cond, &pl->mutex);
+        pthread_mutex_unlock(&pl->mutex);
+
+        pl->callback(pl->user, frame, im, detections);
+
+        pthread_mutex_lock(&pl->mutex);
+        pl->ndelivered++;
+        slot->busy = false;
+        pthread_cond_broadcast(&pl->cond);
+    }
+    pthread_mutex_unlock(&pl->mutex);
+
+    return NULL;
+}
+
+// a detector with the options and families of td.
+static apriltag_detector_t *pipeline_detector_create(apriltag_detector_t *td)
+{
+    apriltag_detector_t *copy = apriltag_detector_create();
+
+    copy->nthreads = td->nthreads;
+    copy->quad_decimate = td->quad_decimate;
+    copy->quad_sigma = td->quad_sigma;
+    copy->refine_edges = td->refine_edges;
+    copy->refine_edges_skip_mse = td->refine_edges_skip_mse;
+    copy->decode_sharpening = td->decode_sharpening;
+    copy->fixed_point_sampling = td->fixed_point_sampling;
+    copy->max_decode_table_bytes = td->max_decode_table_bytes;
+    copy->lazy_decode_tables = td->lazy_decode_tables;
+    copy->qtp = td->qtp;
+
+    // the debug images of the frames in flight would overwrite each
+    // other.
+    copy->debug = false;
+
+    // the families' decoders are already built, and are shared.
+    for (int i = 0; i < zarray_size(td->tag_families); i++) {
+        apriltag_family_t *fam;
+        zarray_get(td->tag_families, i, &fam);
+        apriltag_detector_add_family(copy, fam);
+    }
+
+    return copy;
+}
+
+apriltag_pipeline_t *apriltag_pipeline_create(apriltag_detector_t *td, int depth,
+                                              apriltag_pipeline_callback_t callback, void *user)
+{
+    assert(depth > 0);
+
+    apriltag_pipeline_t *pl = calloc(1, sizeof(apriltag_pipeline_t));
+    pl->depth = depth;
+    pl->callback = callback;
+    pl->user = user;
+    pl->slots = calloc(depth, sizeof(struct pipeline_slot));
+
+    pthread_mutex_init(&pl->mutex, NULL);
+    pthread_cond_init(&pl->cond, NULL);
+
+    for (int i = 0; i < depth; i++) {
+        struct pipeline_slot *slot = &pl->slots[i];
+        slot->pl = pl;
+        slot->td = pipeline_detector_create(td);
+
+        if (pthread_create(&slot->thread, NULL, pipeline_thread, slot) != 0) {
+            debug_print("Insufficient system resources to create pipeline threads\n");
+            apriltag_pipeline_destroy(pl);
+            return NULL;
+        }
+        slot->started = true;
+    }
+
+    return pl;
+}
+
+uint64_t apriltag_pipeline_submit(apriltag_pipeline_t *pl, image_u8_t *im)
+{
+    pthread_mutex_lock(&pl->mutex);
+
+    struct pipeline_slot *slot = &pl->slots[pl->nsubmitted % pl->depth];
+    while (slot->busy)
+        pthread_cond_wait(&pl->cond, &pl->mutex);
+
+    uint64_t frame = pl->nsubmitted++;
+    slot->im = im;
+    slot->frame = frame;
+    slot->busy = true;
+    pthread_cond_broadcast(&pl->cond);
+
+    pthread_mutex_unlock(&pl->mutex);
+
+    return frame;
+}
+
+void apriltag_pipeline_flush(apriltag_pipeline_t *pl)
+{
+    pthread_mutex_lock(&pl->mutex);
+    while (pl->ndelivered != pl->nsubmitted)
+        pthread_cond_wait(&pl->cond, &pl->mutex);
+    pthread_mutex_unlock(&pl->mutex);
+}
+
+void apriltag_pipeline_destroy(apriltag_pipeline_t *pl)
+{
+    if (pl == NULL)
+        return;
+
+    apriltag_pipeline_flush(pl);
+
+    pthread_mutex_lock(&pl->mutex);
+    pl->stop = true;
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->mutex);
+
+    for (int i = 0; i < pl->depth; i++) {
+        struct pipeline_slot *slot = &pl->slots[i];
+        if (slot->started)
+            pthread_join(slot->thread, NULL);
+        if (slot->td)
+            apriltag_detector_destroy(slot->td);
+    }
+
+    pthread_mutex_destroy(&pl->mutex);
+    pthread_cond_destroy(&pl->cond);
+    free(pl->slots);
+    free(pl);
+}
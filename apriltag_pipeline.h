@@ -0,0 +1,78 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "apriltag.h"
+
+// Detects tags in a stream of frames with several frames in flight at
+// once, so that frame N+1 is already being thresholded while frame N
+// is still in quad fitting or decoding, and the threads that would sit
+// idle at the barriers between the stages of one frame have work.
+//
+// Each frame in flight has its own detector (configured like the one
+// the pipeline was created from, with nthreads threads of its own), so
+// the added latency is bounded by the depth of the pipeline.
+typedef struct apriltag_pipeline apriltag_pipeline_t;
+
+// Called with the detections of each frame (an array of
+// apriltag_detection_t*, which the callback owns and must destroy
+// with apriltag_detections_destroy()), strictly in the order the
+// frames were submitted and never concurrently. frame is the number
+// apriltag_pipeline_submit() returned. The callback must not submit
+// or flush.
+typedef void (*apriltag_pipeline_callback_t)(void *user, uint64_t frame, image_u8_t *im,
+                                             zarray_t *detections);
+
+// Creates a pipeline with up to depth frames in flight, detecting with
+// the options and families of td at this time (later changes to td
+// don't affect it, and td stays free for other use). The families
+// must outlive the pipeline. Returns NULL if a thread couldn't be
+// created.
+apriltag_pipeline_t *apriltag_pipeline_create(apriltag_detector_t *td, int depth,
+                                              apriltag_pipeline_callback_t callback, void *user);
+
+// Queues im for detection, waiting while depth frames are in flight,
+// and returns its frame number (counting from 0). im must stay valid
+// and unmodified until its callback.
+uint64_t apriltag_pipeline_submit(apriltag_pipeline_t *pl, image_u8_t *im);
+
+// Waits until the callbacks of all submitted frames have returned.
+void apriltag_pipeline_flush(apriltag_pipeline_t *pl);
+
+// Flushes, then destroys the pipeline and its detectors.
+void apriltag_pipeline_destroy(apriltag_pipeline_t *pl);
+
+#ifdef __cplusplus
+}
+#endif
@@ -44,6 +44,21 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include "common/postscript_utils.h"
 #include "common/math_util.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define APRILTAG_THRESH_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) && !defined(_MSC_VER)
+// AVX2 kernels are compiled with a target attribute and selected at
+// runtime, so the library still runs on CPUs without AVX2.
+#define APRILTAG_THRESH_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+// defined in apriltag.c
+extern arena_t *apriltag_detector_borrow_arena(apriltag_detector_t *td);
+extern void apriltag_detector_return_arena(apriltag_detector_t *td, arena_t *arena);
+
 #ifdef _WIN32
 static inline long int random(void)
 {
@@ -59,6 +74,7 @@ struct uint64_zarray_entry
 {
     uint64_t id;
     zarray_t *cluster;
+    uint32_t last_pixel; // the pixel that added the last point.
 
     struct uint64_zarray_entry *next;
 };
@@ -72,20 +88,125 @@ struct pt
     float slope;
 };
 
+// The points of one cluster, which are contiguous in memory.
+struct cluster_span
+{
+    struct pt *pts;
+    int sz;
+};
+
+// A gradient point (without its slope, which fit_quad() computes)
+// tagged with the cluster it belongs to, as a dense index into the
+// clusters found by one task.
+struct cluster_pt
+{
+    uint32_t cidx;
+    uint16_t x, y;
+    int16_t gx, gy;
+};
+
+// A flat array of the gradient points found by one task, in scan
+// order. The cluster indices are assigned in order of first
+// appearance, through a small open-addressing table from cluster id to
+// index, so a counting sort by index makes the points of each cluster
+// contiguous.
+struct cluster_pts
+{
+    struct cluster_pt *data;
+    int size, alloc;
+
+    // for each cluster index: its cluster id and number of points (or,
+    // while sorting, where its next point goes), and the pixel that
+    // added its last point, and where that point is.
+    uint64_t *ids;
+    uint32_t *counts;
+    uint32_t *last_pixel, *last_pt;
+    int nclusters, clusters_alloc;
+
+    // cluster id -> 1 + cluster index, or 0 if empty. A power of two
+    // in size.
+    uint32_t *table;
+    int table_size;
+};
+
+// The thresholded image packed into two bitplanes of one bit per
+// pixel. A pixel is "valid" if it was binarized, i.e. it is not part of
+// a low-contrast region (127 in the byte image), and its "value" bit
+// is set if it is white. The value bit of an invalid pixel is always
+// zero, so two pixels are equal in the byte image iff both of their
+// bits are equal. Pixel x of row y is bit (x & 63) of word
+// y*wstride + (x >> 6); the bits past the width of the image are zero.
+typedef struct thresh_bits thresh_bits_t;
+struct thresh_bits
+{
+    int width, height;
+    int wstride; // 64-bit words per row
+    uint64_t *valid;
+    uint64_t *value;
+};
+
+// Connected components over runs rather than pixels. Each row is split
+// into maximal runs of equal, binarized pixels, which become the
+// elements of the union-find (weighted by their length, so set sizes
+// are still pixel counts). Only runs of adjacent rows need to be
+// connected.
+//
+// The connectivity is exactly that of do_unionfind_line2(): pixels x-1
+// and x are connected for x in [1, w-2] (so the last column is never
+// joined to its left neighbor and always forms runs of its own), and
+// a pixel x in [1, w-2] is connected to the pixel above it and, if it
+// is white, to the two diagonal pixels above it.
+struct ccl_run
+{
+    uint16_t x0, x1; // [x0, x1)
+    uint8_t v; // 0 or 255
+};
+
+typedef struct ccl_runs ccl_runs_t;
+struct ccl_runs
+{
+    int w, h;
+
+    // the runs of row y are [row_start[y], row_start[y+1]).
+    uint32_t *row_start;
+    struct ccl_run *runs;
+    uint32_t nruns;
+
+    unionfind_t *uf;
+};
+
+struct run_task
+{
+    int y0, y1;
+    image_u8_t *im;
+    thresh_bits_t *bits; // if non-NULL, used instead of im.
+    ccl_runs_t *cr;
+
+    // the runs of rows [y0, y1), before they are copied into cr.
+    struct ccl_run *runs;
+    int nruns, alloc;
+};
+
 struct unionfind_task
 {
     int y0, y1;
     int w, h, s;
     unionfind_t *uf;
     image_u8_t *im;
+    thresh_bits_t *bits; // if non-NULL, used instead of im.
+    ccl_runs_t *runs; // for connecting runs instead of pixels.
 };
 
 struct quad_task
 {
-    zarray_t *clusters;
+    zarray_t *clusters; // of struct cluster_span
     int cidx0, cidx1; // [cidx0, cidx1)
-    zarray_t *quads;
     apriltag_detector_t *td;
+
+    // the task's own output, with room for a quad per cluster that
+    // quad_cluster_fits().
+    struct quad *quads;
+    int nquads;
     int w, h;
 
     image_u8_t *im;
@@ -101,14 +222,35 @@ struct cluster_task
     int y1;
     int w;
     int s;
+    int h;
     int nclustermap;
     unionfind_t* uf;
+    ccl_runs_t *runs; // if non-NULL, used instead of uf.
     image_u8_t* im;
+    thresh_bits_t *bits; // if non-NULL, used instead of im.
     zarray_t* clusters;
+    bool merge_points;
+
+    // if sorted, the points are put in pts rather than clusters, and
+    // later moved to dst.
+    bool sorted;
+    struct cluster_pts pts;
+    struct pt *dst;
+};
+
+enum threshold_isa {
+    THRESHOLD_ISA_SCALAR,
+    THRESHOLD_ISA_SSE2,
+    THRESHOLD_ISA_AVX2,
+};
+
+struct threshold_kernels {
+    enum threshold_isa isa;
 };
 
 struct minmax_task {
     int ty;
+    const struct threshold_kernels *kernels;
 
     image_u8_t *im;
     uint8_t *im_max;
@@ -117,6 +259,7 @@ struct minmax_task {
 
 struct blur_task {
     int ty;
+    const struct threshold_kernels *kernels;
 
     image_u8_t *im;
     uint8_t *im_max;
@@ -127,6 +270,7 @@ struct blur_task {
 
 struct threshold_task {
     int ty;
+    const struct threshold_kernels *kernels;
 
     apriltag_detector_t *td;
     image_u8_t *im;
@@ -135,6 +279,20 @@ struct threshold_task {
     uint8_t *im_min;
 };
 
+struct threshold_band_task {
+    int ty0, ty1; // [ty0, ty1)
+    const struct threshold_kernels *kernels;
+
+    apriltag_detector_t *td;
+    image_u8_t *im;
+    image_u8_t *threshim;
+    thresh_bits_t *bits; // if non-NULL, written instead of threshim.
+
+    // scratch for three rows of tile statistics plus the blurred row,
+    // 8*tw bytes.
+    uint8_t *window;
+};
+
 struct remove_vertex
 {
     int i;           // which vertex to remove?
@@ -320,9 +478,8 @@ int err_compare_descending(const void *_a, const void *_b)
   rather than pairs of clusters.) Critically, this helps keep nearby
   edges from becoming connected.
 */
-int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_fit_pt *lfps, int indices[4])
+int quad_segment_maxima(apriltag_detector_t *td, int sz, struct line_fit_pt *lfps, int indices[4], arena_t *arena)
 {
-    int sz = zarray_size(cluster);
 
     // ksz: when fitting points, how many points on either side do we consider?
     // (actual "kernel" width is 2ksz).
@@ -341,7 +498,7 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
     if (ksz < 2)
         return 0;
 
-    double *errs = malloc(sizeof(double)*sz);
+    double *errs = arena_alloc(arena, sizeof(double)*sz);
 
     for (int i = 0; i < sz; i++) {
         fit_line(lfps, sz, (i + sz - ksz) % sz, (i + ksz) % sz, NULL, &errs[i], NULL);
@@ -349,7 +506,7 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
 
     // apply a low-pass filter to errs
     if (1) {
-        double *y = malloc(sizeof(double)*sz);
+        double *y = arena_alloc(arena, sizeof(double)*sz);
 
         // how much filter to apply?
 
@@ -371,7 +528,7 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
 
         // For default values of cutoff = 0.05, sigma = 3,
         // we have fsz = 17.
-        float *f = malloc(sizeof(float)*fsz);
+        float *f = arena_alloc(arena, sizeof(float)*fsz);
 
         for (int i = 0; i < fsz; i++) {
             int j = i - fsz / 2;
@@ -388,12 +545,10 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
         }
 
         memcpy(errs, y, sizeof(double)*sz);
-        free(y);
-        free(f);
     }
 
-    int *maxima = malloc(sizeof(int)*sz);
-    double *maxima_errs = malloc(sizeof(double)*sz);
+    int *maxima = arena_alloc(arena, sizeof(int)*sz);
+    double *maxima_errs = arena_alloc(arena, sizeof(double)*sz);
     int nmaxima = 0;
 
     for (int i = 0; i < sz; i++) {
@@ -403,12 +558,9 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
             nmaxima++;
         }
     }
-    free(errs);
 
     // if we didn't get at least 4 maxima, we can't fit a quad.
     if (nmaxima < 4){
-        free(maxima);
-        free(maxima_errs);
         return 0;
     }
 
@@ -416,7 +568,7 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
     int max_nmaxima = td->qtp.max_nmaxima;
 
     if (nmaxima > max_nmaxima) {
-        double *maxima_errs_copy = malloc(sizeof(double)*nmaxima);
+        double *maxima_errs_copy = arena_alloc(arena, sizeof(double)*nmaxima);
         memcpy(maxima_errs_copy, maxima_errs, sizeof(double)*nmaxima);
 
         // throw out all but the best handful of maxima. Sorts descending.
@@ -430,9 +582,7 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
             maxima[out++] = maxima[in];
         }
         nmaxima = out;
-        free(maxima_errs_copy);
     }
-    free(maxima_errs);
 
     int best_indices[4];
     double best_error = HUGE_VALF;
@@ -490,8 +640,6 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
         }
     }
 
-    free(maxima);
-
     if (best_error == HUGE_VALF)
         return 0;
 
@@ -504,9 +652,8 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
 }
 
 // returns 0 if the cluster looks bad.
-int quad_segment_agg(zarray_t *cluster, struct line_fit_pt *lfps, int indices[4])
+int quad_segment_agg(int sz, struct line_fit_pt *lfps, int indices[4], arena_t *arena)
 {
-    int sz = zarray_size(cluster);
 
     zmaxheap_t *heap = zmaxheap_create(sizeof(struct remove_vertex*));
 
@@ -518,9 +665,9 @@ int quad_segment_agg(zarray_t *cluster, struct line_fit_pt *lfps, int indices[4]
 
     int rvalloc_pos = 0;
     int rvalloc_size = 3*sz;
-    struct remove_vertex *rvalloc = calloc(rvalloc_size, sizeof(struct remove_vertex));
+    struct remove_vertex *rvalloc = arena_calloc(arena, rvalloc_size, sizeof(struct remove_vertex));
 
-    struct segment *segs = calloc(sz, sizeof(struct segment));
+    struct segment *segs = arena_calloc(arena, sz, sizeof(struct segment));
 
     // populate with initial entries
     for (int i = 0; i < sz; i++) {
@@ -599,7 +746,6 @@ int quad_segment_agg(zarray_t *cluster, struct line_fit_pt *lfps, int indices[4]
         nvertices--;
     }
 
-    free(rvalloc);
     zmaxheap_destroy(heap);
 
     int idx = 0;
@@ -609,8 +755,6 @@ int quad_segment_agg(zarray_t *cluster, struct line_fit_pt *lfps, int indices[4]
         }
     }
 
-    free(segs);
-
     return 1;
 }
 
@@ -618,12 +762,11 @@ int quad_segment_agg(zarray_t *cluster, struct line_fit_pt *lfps, int indices[4]
  * Compute statistics that allow line fit queries to be
  * efficiently computed for any contiguous range of indices.
  */
-struct line_fit_pt* compute_lfps(int sz, zarray_t* cluster, image_u8_t* im) {
-    struct line_fit_pt *lfps = calloc(sz, sizeof(struct line_fit_pt));
+struct line_fit_pt* compute_lfps(int sz, struct pt *pts, image_u8_t* im, arena_t *arena) {
+    struct line_fit_pt *lfps = arena_calloc(arena, sz, sizeof(struct line_fit_pt));
 
     for (int i = 0; i < sz; i++) {
-        struct pt *p;
-        zarray_get_volatile(cluster, i, &p);
+        struct pt *p = &pts[i];
 
         if (i > 0) {
             memcpy(&lfps[i], &lfps[i-1], sizeof(struct line_fit_pt));
@@ -660,7 +803,56 @@ struct line_fit_pt* compute_lfps(int sz, zarray_t* cluster, image_u8_t* im) {
     return lfps;
 }
 
-static inline void ptsort(struct pt *pts, int sz)
+static void ptsort(struct pt *pts, int sz, struct pt *scratch);
+
+// Merges the sorted runs as and bs into pts.
+static inline void ptmerge(struct pt *as, int asz, struct pt *bs, int bsz, struct pt *pts)
+{
+    #define MERGE(apos,bpos)                        \
+    if (pt_compare_angle(&(as[apos]), &(bs[bpos])) < 0)        \
+        pts[outpos++] = as[apos++];             \
+    else                                        \
+        pts[outpos++] = bs[bpos++];
+
+    int apos = 0, bpos = 0, outpos = 0;
+    while (apos + 8 < asz && bpos + 8 < bsz) {
+        MERGE(apos,bpos); MERGE(apos,bpos); MERGE(apos,bpos); MERGE(apos,bpos);
+        MERGE(apos,bpos); MERGE(apos,bpos); MERGE(apos,bpos); MERGE(apos,bpos);
+    }
+
+    while (apos < asz && bpos < bsz) {
+        MERGE(apos,bpos);
+    }
+
+    if (apos < asz)
+        memcpy(&pts[outpos], &as[apos], (asz-apos)*sizeof(struct pt));
+    if (bpos < bsz)
+        memcpy(&pts[outpos], &bs[bpos], (bsz-bpos)*sizeof(struct pt));
+
+#undef MERGE
+}
+
+// Writes the sz points of src, sorted, to dst. src is used as temp
+// storage, so its contents are lost.
+static void ptsort_into(struct pt *src, int sz, struct pt *dst)
+{
+    if (sz <= 5) {
+        memcpy(dst, src, sizeof(struct pt) * sz);
+        ptsort(dst, sz, NULL);
+        return;
+    }
+
+    int asz = sz/2;
+    int bsz = sz - asz;
+
+    ptsort(&src[0], asz, &dst[0]);
+    ptsort(&src[asz], bsz, &dst[asz]);
+    ptmerge(&src[0], asz, &src[asz], bsz, dst);
+}
+
+// Sorts the points by slope. scratch must have room for sz points (it
+// is not used when sz <= 5); no memory is allocated.
+static void ptsort(struct pt *pts, int sz, struct pt *scratch)
 {
 #define MAYBE_SWAP(arr,apos,bpos)                                   \
     if (pt_compare_angle(&(arr[apos]), &(arr[bpos])) > 0) {                        \
@@ -713,59 +905,32 @@ static inline void ptsort(struct pt *pts, int sz)
 
 #undef MAYBE_SWAP
 
-    // a merge sort with temp storage.
-
-    struct pt *tmp = malloc(sizeof(struct pt) * sz);
-
-    memcpy(tmp, pts, sizeof(struct pt) * sz);
+    // a merge sort. ptsort() and ptsort_into() alternate between pts
+    // and scratch at each level, so the data is only moved by the
+    // merges.
 
     int asz = sz/2;
     int bsz = sz - asz;
 
-    struct pt *as = &tmp[0];
-    struct pt *bs = &tmp[asz];
-
-    ptsort(as, asz);
-    ptsort(bs, bsz);
-
-    #define MERGE(apos,bpos)                        \
-    if (pt_compare_angle(&(as[apos]), &(bs[bpos])) < 0)        \
-        pts[outpos++] = as[apos++];             \
-    else                                        \
-        pts[outpos++] = bs[bpos++];
-
-    int apos = 0, bpos = 0, outpos = 0;
-    while (apos + 8 < asz && bpos + 8 < bsz) {
-        MERGE(apos,bpos); MERGE(apos,bpos); MERGE(apos,bpos); MERGE(apos,bpos);
-        MERGE(apos,bpos); MERGE(apos,bpos); MERGE(apos,bpos); MERGE(apos,bpos);
-    }
-
-    while (apos < asz && bpos < bsz) {
-        MERGE(apos,bpos);
-    }
-
-    if (apos < asz)
-        memcpy(&pts[outpos], &as[apos], (asz-apos)*sizeof(struct pt));
-    if (bpos < bsz)
-        memcpy(&pts[outpos], &bs[bpos], (bsz-bpos)*sizeof(struct pt));
-
-    free(tmp);
-
-#undef MERGE
+    ptsort_into(&pts[0], asz, &scratch[0]);
+    ptsort_into(&pts[asz], bsz, &scratch[asz]);
+    ptmerge(&scratch[0], asz, &scratch[asz], bsz, pts);
 }
 
-// return 1 if the quad looks okay, 0 if it should be discarded
+// return 1 if the quad looks okay, 0 if it should be discarded.
+// Temporary buffers are taken from arena and not released.
 int fit_quad(
         apriltag_detector_t *td,
         image_u8_t *im,
-        zarray_t *cluster,
+        struct pt *pts,
+        int sz,
+        arena_t *arena,
         struct quad *quad,
         int tag_width,
         bool normal_border,
         bool reversed_border) {
     int res = 0;
 
-    int sz = zarray_size(cluster);
     if (sz < 24) // Synchronize with later check.
         return 0;
 
@@ -776,15 +941,13 @@ int fit_quad(
 
     // compute a bounding box so that we can order the points
     // according to their angle WRT the center.
-    struct pt *p1;
-    zarray_get_volatile(cluster, 0, &p1);
+    struct pt *p1 = &pts[0];
     uint16_t xmax = p1->x;
     uint16_t xmin = p1->x;
     uint16_t ymax = p1->y;
     uint16_t ymin = p1->y;
-    for (int pidx = 1; pidx < zarray_size(cluster); pidx++) {
-        struct pt *p;
-        zarray_get_volatile(cluster, pidx, &p);
+    for (int pidx = 1; pidx < sz; pidx++) {
+        struct pt *p = &pts[pidx];
 
         if (p->x > xmax) {
             xmax = p->x;
@@ -815,9 +978,8 @@ int fit_quad(
 
     float quadrants[2][2] = {{-1*(2 << 15), 0}, {2*(2 << 15), 2 << 15}};
 
-    for (int pidx = 0; pidx < zarray_size(cluster); pidx++) {
-        struct pt *p;
-        zarray_get_volatile(cluster, pidx, &p);
+    for (int pidx = 0; pidx < sz; pidx++) {
+        struct pt *p = &pts[pidx];
 
         float dx = p->x - cx;
         float dy = p->y - cy;
@@ -850,17 +1012,17 @@ int fit_quad(
     // we now sort the points according to theta. This is a prepatory
     // step for segmenting them into four lines.
     if (1) {
-        ptsort((struct pt*) cluster->data, zarray_size(cluster));
+        ptsort(pts, sz, arena_alloc(arena, sizeof(struct pt)*sz));
     }
 
-    struct line_fit_pt *lfps = compute_lfps(sz, cluster, im);
+    struct line_fit_pt *lfps = compute_lfps(sz, pts, im, arena);
 
     int indices[4];
     if (1) {
-        if (!quad_segment_maxima(td, cluster, lfps, indices))
+        if (!quad_segment_maxima(td, sz, lfps, indices, arena))
             goto finish;
     } else {
-        if (!quad_segment_agg(cluster, lfps, indices))
+        if (!quad_segment_agg(sz, lfps, indices, arena))
             goto finish;
     }
 
@@ -878,6 +1040,9 @@ int fit_quad(
             res = 0;
             goto finish;
         }
+
+        // line i runs from corner i-1 to corner i.
+        quad->line_mse[(i + 3) & 3] = mse;
     }
 
     for (int i = 0; i < 4; i++) {
@@ -974,14 +1139,22 @@ int fit_quad(
 
   finish:
 
-    free(lfps);
-
     return res;
 }
 
-#define DO_UNIONFIND2(dx, dy) if (im->buf[(y + dy)*s + x + dx] == v) unionfind_connect(uf, y*w + x, (y + dy)*w + x + dx);
+// The union-find is either used by a single thread, or concurrently by
+// all of them.
+static inline void ccl_connect(unionfind_t *uf, bool concurrent, uint32_t aid, uint32_t bid)
+{
+    if (concurrent)
+        unionfind_connect_concurrent(uf, aid, bid);
+    else
+        unionfind_connect(uf, aid, bid);
+}
+
+#define DO_UNIONFIND2(dx, dy) if (im->buf[(y + dy)*s + x + dx] == v) ccl_connect(uf, concurrent, y*w + x, (y + dy)*w + x + dx);
 
-static void do_unionfind_first_line(unionfind_t *uf, image_u8_t *im, int w, int s)
+static void do_unionfind_first_line(unionfind_t *uf, bool concurrent, image_u8_t *im, int w, int s)
 {
     int y = 0;
     uint8_t v;
@@ -996,7 +1169,7 @@ static void do_unionfind_first_line(unionfind_t *uf, image_u8_t *im, int w, int
     }
 }
 
-static void do_unionfind_line2(unionfind_t *uf, image_u8_t *im, int w, int s, int y)
+static void do_unionfind_line2(unionfind_t *uf, bool concurrent, image_u8_t *im, int w, int s, int y)
 {
     assert(y > 0);
 
@@ -1037,13 +1210,171 @@ static void do_unionfind_line2(unionfind_t *uf, image_u8_t *im, int w, int s, in
 }
 #undef DO_UNIONFIND2
 
+// Word-at-a-time helpers for the packed image. bits_left() returns word
+// k of the row shifted so that bit i holds pixel i-1 (the left
+// neighbor), bits_right() so that bit i holds pixel i+1.
+static inline uint64_t bits_left(const uint64_t *row, int k)
+{
+    return (row[k] << 1) | (k > 0 ? row[k-1] >> 63 : 0);
+}
+
+static inline uint64_t bits_right(const uint64_t *row, int k, int wstride)
+{
+    return (row[k] >> 1) | (k + 1 < wstride ? row[k+1] << 63 : 0);
+}
+
+// mask of the bits of word k that lie in the pixel range [x0, x1).
+static inline uint64_t bits_span(int k, int x0, int x1)
+{
+    int lo = imax(0, x0 - 64*k);
+    int hi = imin(64, x1 - 64*k);
+    if (hi <= lo)
+        return 0;
+    uint64_t m = (hi == 64) ? ~(uint64_t) 0 : (((uint64_t) 1) << hi) - 1;
+    return m & ~((((uint64_t) 1) << lo) - 1);
+}
+
+// Bit i is set if the two pixels are equal in the byte image.
+#define BITS_EQ(va, ua, vb, ub) (~(((va) ^ (vb)) | ((ua) ^ (ub))))
+
+// These are do_unionfind_first_line() and do_unionfind_line2() on the
+// packed image. The per-pixel tests of those functions are evaluated
+// for 64 pixels at a time, and only the pixels that have some
+// connection to make are visited, in the same order, so that the
+// resulting union-find forest is identical.
+static void do_unionfind_first_line_bits(unionfind_t *uf, bool concurrent, thresh_bits_t *bits)
+{
+    int w = bits->width, ws = bits->wstride;
+    const uint64_t *V = bits->valid, *U = bits->value;
+
+    for (int k = 0; k < ws; k++) {
+        uint64_t v = V[k] & bits_span(k, 1, w - 1);
+        uint64_t left = v & BITS_EQ(V[k], U[k], bits_left(V, k), bits_left(U, k));
+
+        while (left) {
+            uint32_t id = 64*k + ctz64(left);
+            left &= left - 1;
+            ccl_connect(uf, concurrent, id, id - 1);
+        }
+    }
+}
+
+static void do_unionfind_line_bits(unionfind_t *uf, bool concurrent, thresh_bits_t *bits, int y)
+{
+    assert(y > 0);
+
+    int w = bits->width, ws = bits->wstride;
+    const uint64_t *V = &bits->valid[y*ws], *U = &bits->value[y*ws];
+    const uint64_t *Vu = V - ws, *Uu = U - ws;
+
+    for (int k = 0; k < ws; k++) {
+        uint64_t v = V[k] & bits_span(k, 1, w - 1);
+        if (v == 0)
+            continue;
+
+        // the pixel itself and its neighbors at (-1,0), (0,-1),
+        // (-1,-1) and (1,-1).
+        uint64_t v_0_0 = V[k], u_0_0 = U[k];
+        uint64_t v_m1_0 = bits_left(V, k), u_m1_0 = bits_left(U, k);
+        uint64_t v_0_m1 = Vu[k], u_0_m1 = Uu[k];
+        uint64_t v_m1_m1 = bits_left(Vu, k), u_m1_m1 = bits_left(Uu, k);
+        uint64_t v_1_m1 = bits_right(Vu, k, ws), u_1_m1 = bits_right(Uu, k, ws);
+
+        uint64_t first = (k == 0) ? 2 : 0; // x == 1
+        uint64_t eq_left_upleft = BITS_EQ(v_m1_0, u_m1_0, v_m1_m1, u_m1_m1);
+        uint64_t eq_upleft_up = BITS_EQ(v_m1_m1, u_m1_m1, v_0_m1, u_0_m1);
+
+        uint64_t left = v & BITS_EQ(v_0_0, u_0_0, v_m1_0, u_m1_0);
+        uint64_t up = v & (first | ~(eq_left_upleft & eq_upleft_up)) &
+            BITS_EQ(v_0_0, u_0_0, v_0_m1, u_0_m1);
+
+        uint64_t white = v & u_0_0;
+        uint64_t upleft = white & (first | ~(eq_left_upleft | eq_upleft_up)) &
+            BITS_EQ(v_0_0, u_0_0, v_m1_m1, u_m1_m1);
+        uint64_t upright = white & ~BITS_EQ(v_0_m1, u_0_m1, v_1_m1, u_1_m1) &
+            BITS_EQ(v_0_0, u_0_0, v_1_m1, u_1_m1);
+
+        uint64_t todo = left | up | upleft | upright;
+        while (todo) {
+            int b = ctz64(todo);
+            uint64_t bit = ((uint64_t) 1) << b;
+            uint32_t id = y*w + 64*k + b;
+            todo &= todo - 1;
+
+            if (left & bit)
+                ccl_connect(uf, concurrent, id, id - 1);
+            if (up & bit)
+                ccl_connect(uf, concurrent, id, id - w);
+            if (upleft & bit)
+                ccl_connect(uf, concurrent, id, id - w - 1);
+            if (upright & bit)
+                ccl_connect(uf, concurrent, id, id - w + 1);
+        }
+    }
+}
+
+// connects the rows [y0, y1) with the concurrent union-find.
 static void do_unionfind_task2(void *p)
 {
     struct unionfind_task *task = (struct unionfind_task*) p;
 
     for (int y = task->y0; y < task->y1; y++) {
-        do_unionfind_line2(task->uf, task->im, task->w, task->s, y);
+        if (task->bits) {
+            if (y == 0)
+                do_unionfind_first_line_bits(task->uf, true, task->bits);
+            else
+                do_unionfind_line_bits(task->uf, true, task->bits, y);
+        } else {
+            if (y == 0)
+                do_unionfind_first_line(task->uf, true, task->im, task->w, task->s);
+            else
+                do_unionfind_line2(task->uf, true, task->im, task->w, task->s, y);
+        }
+    }
+}
+
+struct unionfind_size_task
+{
+    unionfind_t *uf;
+    uint32_t id0, id1;
+};
+
+static void do_unionfind_size_task(void *p)
+{
+    struct unionfind_size_task *task = (struct unionfind_size_task*) p;
+
+    unionfind_count_sizes_concurrent(task->uf, task->id0, task->id1);
+}
+
+// compute the set sizes after concurrent unions of the ids [0, n).
+static void unionfind_count_sizes_parallel(apriltag_detector_t *td, unionfind_t *uf, uint32_t n)
+{
+    uint32_t chunksize = 1 + n / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
+    struct unionfind_size_task *tasks = arena_alloc(td->frame_arena, sizeof(struct unionfind_size_task)*(n / chunksize + 1));
+
+    int ntasks = 0;
+    for (uint32_t i = 0; i < n; i += chunksize) {
+        tasks[ntasks].uf = uf;
+        tasks[ntasks].id0 = i;
+        tasks[ntasks].id1 = n - i < chunksize ? n : i + chunksize;
+
+        workerpool_add_task(td->wp, do_unionfind_size_task, &tasks[ntasks]);
+        ntasks++;
     }
+
+    workerpool_run(td->wp);
+}
+
+// Whether a cluster is worth fitting a quad to, in a w x h image.
+static inline bool quad_cluster_fits(apriltag_detector_t *td, const struct cluster_span *cluster, int w, int h)
+{
+    // a cluster should contain only boundary points around the
+    // tag. it cannot be bigger than the whole screen. (Reject
+    // large connected blobs that will be prohibitively slow to
+    // fit quads to.) A typical point along an edge is added two
+    // times (because it has 2 unique neighbors). The maximum
+    // perimeter is 2w+2h.
+    return cluster->sz >= td->qtp.min_cluster_pixels && cluster->sz <= 2*(2*w+2*h);
 }
 
 static void do_quad_task(void *p)
@@ -1051,56 +1382,50 @@ static void do_quad_task(void *p)
     struct quad_task *task = (struct quad_task*) p;
 
     zarray_t *clusters = task->clusters;
-    zarray_t *quads = task->quads;
     apriltag_detector_t *td = task->td;
     int w = task->w, h = task->h;
 
+    arena_t *arena = apriltag_detector_borrow_arena(td);
+
     for (int cidx = task->cidx0; cidx < task->cidx1; cidx++) {
 
-        zarray_t **cluster;
+        struct cluster_span *cluster;
         zarray_get_volatile(clusters, cidx, &cluster);
 
-        if (zarray_size(*cluster) < td->qtp.min_cluster_pixels)
-            continue;
-
-        // a cluster should contain only boundary points around the
-        // tag. it cannot be bigger than the whole screen. (Reject
-        // large connected blobs that will be prohibitively slow to
-        // fit quads to.) A typical point along an edge is added two
-        // times (because it has 2 unique neighbors). The maximum
-        // perimeter is 2w+2h.
-        if (zarray_size(*cluster) > 2*(2*w+2*h)) {
+        if (!quad_cluster_fits(td, cluster, w, h))
             continue;
-        }
 
-        struct quad quad;
-        memset(&quad, 0, sizeof(struct quad));
+        struct quad *quad = &task->quads[task->nquads];
+        memset(quad, 0, sizeof(struct quad));
 
-        if (fit_quad(td, task->im, *cluster, &quad, task->tag_width, task->normal_border, task->reversed_border)) {
-            pthread_mutex_lock(&td->mutex);
-            zarray_add(quads, &quad);
-            pthread_mutex_unlock(&td->mutex);
+        if (fit_quad(td, task->im, cluster->pts, cluster->sz, arena, quad, task->tag_width, task->normal_border, task->reversed_border)) {
+            task->nquads++;
         }
+
+        arena_reset(arena);
     }
+
+    apriltag_detector_return_arena(td, arena);
 }
 
-void do_minmax_task(void *p)
+// The three tile passes of threshold() are written as per-row kernels so
+// that they can be vectorized. The scalar versions work on any range of
+// tiles; the SSE2/AVX2 versions handle as many tiles as fit in a
+// register at once and hand the remainder to the scalar code. All
+// variants produce identical output.
+static void tile_minmax_scalar(const uint8_t *buf, int s, int tx0, int tx1,
+                               uint8_t *im_max, uint8_t *im_min)
 {
     const int tilesz = 4;
-    struct minmax_task* task = (struct minmax_task*) p;
-    int s = task->im->stride;
-    int ty = task->ty;
-    int tw = task->im->width / tilesz;
-    image_u8_t *im = task->im;
 
-    for (int tx = 0; tx < tw; tx++) {
+    for (int tx = tx0; tx < tx1; tx++) {
         uint8_t max = 0, min = 255;
 
         for (int dy = 0; dy < tilesz; dy++) {
 
             for (int dx = 0; dx < tilesz; dx++) {
 
-                uint8_t v = im->buf[(ty*tilesz+dy)*s + tx*tilesz + dx];
+                uint8_t v = buf[dy*s + tx*tilesz + dx];
                 if (v < min)
                     min = v;
                 if (v > max)
@@ -1108,71 +1433,55 @@ void do_minmax_task(void *p)
             }
         }
 
-        task->im_max[ty*tw+tx] = max;
-        task->im_min[ty*tw+tx] = min;
+        im_max[tx] = max;
+        im_min[tx] = min;
     }
 }
 
-void do_blur_task(void *p)
+// rows[] holds the (unblurred) tile rows above, at and below the
+// current row; rows that fall outside the image are NULL.
+static void tile_blur_scalar(const uint8_t *max_rows[3], const uint8_t *min_rows[3],
+                             int tx0, int tx1, int tw, uint8_t *out_max, uint8_t *out_min)
 {
-    const int tilesz = 4;
-    struct blur_task* task = (struct blur_task*) p;
-    int ty = task->ty;
-    int tw = task->im->width / tilesz;
-    int th = task->im->height / tilesz;
-    uint8_t *im_max = task->im_max;
-    uint8_t *im_min = task->im_min;
-
-    for (int tx = 0; tx < tw; tx++) {
+    for (int tx = tx0; tx < tx1; tx++) {
         uint8_t max = 0, min = 255;
 
-        for (int dy = -1; dy <= 1; dy++) {
-            if (ty+dy < 0 || ty+dy >= th)
+        for (int dy = 0; dy < 3; dy++) {
+            if (max_rows[dy] == NULL)
                 continue;
             for (int dx = -1; dx <= 1; dx++) {
                 if (tx+dx < 0 || tx+dx >= tw)
                     continue;
 
-                uint8_t m = im_max[(ty+dy)*tw+tx+dx];
+                uint8_t m = max_rows[dy][tx+dx];
                 if (m > max)
                     max = m;
-                m = im_min[(ty+dy)*tw+tx+dx];
+                m = min_rows[dy][tx+dx];
                 if (m < min)
                     min = m;
             }
         }
 
-        task->im_max_tmp[ty*tw + tx] = max;
-        task->im_min_tmp[ty*tw + tx] = min;
+        out_max[tx] = max;
+        out_min[tx] = min;
     }
 }
 
-void do_threshold_task(void *p)
+static void tile_threshold_scalar(const uint8_t *src, uint8_t *dst, int s, int tx0, int tx1,
+                                  const uint8_t *im_max, const uint8_t *im_min,
+                                  int min_white_black_diff)
 {
     const int tilesz = 4;
-    struct threshold_task* task = (struct threshold_task*) p;
-    int ty = task->ty;
-    int tw = task->im->width / tilesz;
-    int s = task->im->stride;
-    uint8_t *im_max = task->im_max;
-    uint8_t *im_min = task->im_min;
-    image_u8_t *im = task->im;
-    image_u8_t *threshim = task->threshim;
-    int min_white_black_diff = task->td->qtp.min_white_black_diff;
 
-    for (int tx = 0; tx < tw; tx++) {
-        int min = im_min[ty*tw + tx];
-        int max = im_max[ty*tw + tx];
+    for (int tx = tx0; tx < tx1; tx++) {
+        int min = im_min[tx];
+        int max = im_max[tx];
 
         // low contrast region? (no edges)
         if (max - min < min_white_black_diff) {
             for (int dy = 0; dy < tilesz; dy++) {
-                int y = ty*tilesz + dy;
-
                 for (int dx = 0; dx < tilesz; dx++) {
-                    int x = tx*tilesz + dx;
-
-                    threshim->buf[y*s+x] = 127;
+                    dst[dy*s + tx*tilesz + dx] = 127;
                 }
             }
             continue;
@@ -1185,84 +1494,714 @@ void do_threshold_task(void *p)
         uint8_t thresh = min + (max - min) / 2;
 
         for (int dy = 0; dy < tilesz; dy++) {
-            int y = ty*tilesz + dy;
-
             for (int dx = 0; dx < tilesz; dx++) {
-                int x = tx*tilesz + dx;
-
-                uint8_t v = im->buf[y*s+x];
+                uint8_t v = src[dy*s + tx*tilesz + dx];
                 if (v > thresh)
-                    threshim->buf[y*s+x] = 255;
+                    dst[dy*s + tx*tilesz + dx] = 255;
                 else
-                    threshim->buf[y*s+x] = 0;
+                    dst[dy*s + tx*tilesz + dx] = 0;
             }
         }
     }
 }
- 
-image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
+
+// Same as tile_threshold_scalar(), but sets the bits of the packed
+// image instead (valid and value point at the first of the 4 rows,
+// which must be zero). Low-contrast tiles are left untouched.
+static void tile_threshold_bits_scalar(const uint8_t *src, int s, int tx0, int tx1,
+                                       const uint8_t *im_max, const uint8_t *im_min,
+                                       int min_white_black_diff,
+                                       uint64_t *valid, uint64_t *value, int wstride)
 {
-    int w = im->width, h = im->height, s = im->stride;
-    assert(w < 32768);
-    assert(h < 32768);
+    const int tilesz = 4;
 
-    image_u8_t *threshim = image_u8_create_alignment(w, h, s);
-    assert(threshim->stride == s);
+    for (int tx = tx0; tx < tx1; tx++) {
+        int min = im_min[tx];
+        int max = im_max[tx];
 
-    // The idea is to find the maximum and minimum values in a
-    // window around each pixel. If it's a contrast-free region
-    // (max-min is small), don't try to binarize. Otherwise,
-    // threshold according to (max+min)/2.
-    //
-    // Mark low-contrast regions with value 127 so that we can skip
-    // future work on these areas too.
+        if (max - min < min_white_black_diff)
+            continue;
 
-    // however, computing max/min around every pixel is needlessly
-    // expensive. We compute max/min for tiles. To avoid artifacts
-    // that arise when high-contrast features appear near a tile
-    // edge (and thus moving from one tile to another results in a
-    // large change in max/min value), the max/min values used for
-    // any pixel are computed from all 3x3 surrounding tiles. Thus,
-    // the max/min sampling area for nearby pixels overlap by at least
-    // one tile.
-    //
-    // The important thing is that the windows be large enough to
-    // capture edge transitions; the tag does not need to fit into
-    // a tile.
+        uint8_t thresh = min + (max - min) / 2;
 
-    // XXX Tunable. Generally, small tile sizes--- so long as they're
-    // large enough to span a single tag edge--- seem to be a winner.
-    const int tilesz = 4;
+        for (int dy = 0; dy < tilesz; dy++) {
+            for (int dx = 0; dx < tilesz; dx++) {
+                int x = tx*tilesz + dx;
+                uint64_t bit = ((uint64_t) 1) << (x & 63);
 
-    // the last (possibly partial) tiles along each row and column will
-    // just use the min/max value from the last full tile.
-    int tw = w / tilesz;
-    int th = h / tilesz;
+                valid[dy*wstride + (x >> 6)] |= bit;
+                if (src[dy*s + x] > thresh)
+                    value[dy*wstride + (x >> 6)] |= bit;
+            }
+        }
+    }
+}
 
-    uint8_t *im_max = calloc(tw*th, sizeof(uint8_t));
-    uint8_t *im_min = calloc(tw*th, sizeof(uint8_t));
+#ifdef APRILTAG_THRESH_SSE2
+// Reduce each group of 4 bytes to its max/min, leaving the result in the
+// low byte of each 32-bit lane.
+#define TILE_HMAX_SSE2(v) (v = _mm_max_epu8(v, _mm_srli_epi32(v, 8)), v = _mm_max_epu8(v, _mm_srli_epi32(v, 16)))
+#define TILE_HMIN_SSE2(v) (v = _mm_min_epu8(v, _mm_srli_epi32(v, 8)), v = _mm_min_epu8(v, _mm_srli_epi32(v, 16)))
 
-    struct minmax_task *minmax_tasks = malloc(sizeof(struct minmax_task)*th);
-    // first, collect min/max statistics for each tile
-    for (int ty = 0; ty < th; ty++) {
-        minmax_tasks[ty].im = im;
-        minmax_tasks[ty].im_max = im_max;
-        minmax_tasks[ty].im_min = im_min;
+static void tile_minmax_sse2(const uint8_t *buf, int s, int tw, uint8_t *im_max, uint8_t *im_min)
+{
+    const __m128i lowbyte = _mm_set1_epi32(0xff);
+    int tx = 0;
+
+    // 8 tiles (32 pixels) per iteration.
+    for (; tx + 8 <= tw; tx += 8) {
+        const uint8_t *p = &buf[tx*4];
+        __m128i amax = _mm_loadu_si128((const __m128i*) p);
+        __m128i bmax = _mm_loadu_si128((const __m128i*) (p + 16));
+        __m128i amin = amax, bmin = bmax;
+
+        for (int dy = 1; dy < 4; dy++) {
+            __m128i a = _mm_loadu_si128((const __m128i*) (p + dy*s));
+            __m128i b = _mm_loadu_si128((const __m128i*) (p + dy*s + 16));
+            amax = _mm_max_epu8(amax, a);
+            amin = _mm_min_epu8(amin, a);
+            bmax = _mm_max_epu8(bmax, b);
+            bmin = _mm_min_epu8(bmin, b);
+        }
+
+        TILE_HMAX_SSE2(amax);
+        TILE_HMAX_SSE2(bmax);
+        TILE_HMIN_SSE2(amin);
+        TILE_HMIN_SSE2(bmin);
+
+        __m128i max16 = _mm_packs_epi32(_mm_and_si128(amax, lowbyte), _mm_and_si128(bmax, lowbyte));
+        __m128i min16 = _mm_packs_epi32(_mm_and_si128(amin, lowbyte), _mm_and_si128(bmin, lowbyte));
+        __m128i res = _mm_packus_epi16(max16, min16);
+
+        _mm_storel_epi64((__m128i*) &im_max[tx], res);
+        _mm_storel_epi64((__m128i*) &im_min[tx], _mm_srli_si128(res, 8));
+    }
+
+    tile_minmax_scalar(buf, s, tx, tw, im_max, im_min);
+}
+
+static void tile_blur_sse2(const uint8_t *max_rows[3], const uint8_t *min_rows[3],
+                           int tw, uint8_t *out_max, uint8_t *out_min)
+{
+    // the first and last tile need clamping; do those with scalar code.
+    tile_blur_scalar(max_rows, min_rows, 0, imin(1, tw), tw, out_max, out_min);
+
+    int tx = 1;
+    for (; tx + 16 + 1 <= tw; tx += 16) {
+        __m128i max = _mm_setzero_si128();
+        __m128i min = _mm_set1_epi8((char) 0xff);
+
+        for (int dy = 0; dy < 3; dy++) {
+            if (max_rows[dy] == NULL)
+                continue;
+            for (int dx = -1; dx <= 1; dx++) {
+                max = _mm_max_epu8(max, _mm_loadu_si128((const __m128i*) &max_rows[dy][tx + dx]));
+                min = _mm_min_epu8(min, _mm_loadu_si128((const __m128i*) &min_rows[dy][tx + dx]));
+            }
+        }
+
+        _mm_storeu_si128((__m128i*) &out_max[tx], max);
+        _mm_storeu_si128((__m128i*) &out_min[tx], min);
+    }
+
+    if (tx < tw)
+        tile_blur_scalar(max_rows, min_rows, tx, tw, tw, out_max, out_min);
+}
+
+// Computes the per-tile threshold and "low contrast" mask for 4
+// consecutive tiles, each replicated over the 4 pixels of its tile.
+static inline void tile_thresh4_sse2(const uint8_t *im_max, const uint8_t *im_min,
+                                     __m128i diffm1, __m128i *thresh, __m128i *lowc)
+{
+    int32_t max4, min4;
+    memcpy(&max4, im_max, 4);
+    memcpy(&min4, im_min, 4);
+
+    __m128i max = _mm_cvtsi32_si128(max4);
+    __m128i min = _mm_cvtsi32_si128(min4);
+    __m128i d = _mm_sub_epi8(max, min);
+    __m128i t = _mm_add_epi8(min, _mm_and_si128(_mm_srli_epi16(d, 1), _mm_set1_epi8(0x7f)));
+    __m128i l = _mm_cmpeq_epi8(_mm_min_epu8(d, diffm1), d);
+
+    t = _mm_unpacklo_epi8(t, t);
+    l = _mm_unpacklo_epi8(l, l);
+    *thresh = _mm_unpacklo_epi16(t, t);
+    *lowc = _mm_unpacklo_epi16(l, l);
+}
+
+static void tile_threshold_sse2(const uint8_t *src, uint8_t *dst, int s, int tw,
+                                const uint8_t *im_max, const uint8_t *im_min,
+                                int min_white_black_diff)
+{
+    // A tile is low contrast if (max - min) <= min_white_black_diff - 1.
+    // Outside of [1, 256] the test is either always or never true.
+    if (min_white_black_diff <= 0 || min_white_black_diff > 256) {
+        tile_threshold_scalar(src, dst, s, 0, tw, im_max, im_min, min_white_black_diff);
+        return;
+    }
+    const __m128i diffm1 = _mm_set1_epi8((char) (min_white_black_diff - 1));
+    const __m128i gray = _mm_set1_epi8(127);
+    const __m128i ones = _mm_set1_epi8((char) 0xff);
+
+    int tx = 0;
+    for (; tx + 4 <= tw; tx += 4) {
+        __m128i thresh, lowc;
+        tile_thresh4_sse2(&im_max[tx], &im_min[tx], diffm1, &thresh, &lowc);
+
+        for (int dy = 0; dy < 4; dy++) {
+            __m128i v = _mm_loadu_si128((const __m128i*) &src[dy*s + tx*4]);
+            // v <= thresh ?
+            __m128i le = _mm_cmpeq_epi8(_mm_max_epu8(v, thresh), thresh);
+            __m128i out = _mm_andnot_si128(le, ones);
+            out = _mm_or_si128(_mm_and_si128(lowc, gray), _mm_andnot_si128(lowc, out));
+            _mm_storeu_si128((__m128i*) &dst[dy*s + tx*4], out);
+        }
+    }
+
+    tile_threshold_scalar(src, dst, s, tx, tw, im_max, im_min, min_white_black_diff);
+}
+
+// 4 tiles are 16 pixels, so the byte masks map directly onto 16-bit
+// aligned pieces of the bitplanes.
+static void tile_threshold_bits_sse2(const uint8_t *src, int s, int tx0, int tw,
+                                     const uint8_t *im_max, const uint8_t *im_min,
+                                     int min_white_black_diff,
+                                     uint64_t *valid, uint64_t *value, int wstride)
+{
+    if (min_white_black_diff <= 0 || min_white_black_diff > 256) {
+        tile_threshold_bits_scalar(src, s, tx0, tw, im_max, im_min, min_white_black_diff,
+                                   valid, value, wstride);
+        return;
+    }
+    const __m128i diffm1 = _mm_set1_epi8((char) (min_white_black_diff - 1));
+
+    // tx0 must be a multiple of 4.
+    int tx = tx0;
+    for (; tx + 4 <= tw; tx += 4) {
+        __m128i thresh, lowc;
+        tile_thresh4_sse2(&im_max[tx], &im_min[tx], diffm1, &thresh, &lowc);
+
+        uint64_t vbits = (uint64_t) (~_mm_movemask_epi8(lowc) & 0xffff);
+        if (vbits == 0)
+            continue;
+
+        int x = tx*4;
+        for (int dy = 0; dy < 4; dy++) {
+            __m128i v = _mm_loadu_si128((const __m128i*) &src[dy*s + x]);
+            __m128i le = _mm_cmpeq_epi8(_mm_max_epu8(v, thresh), thresh);
+            uint64_t wbits = vbits & ~(uint64_t) _mm_movemask_epi8(le);
+
+            valid[dy*wstride + (x >> 6)] |= vbits << (x & 63);
+            value[dy*wstride + (x >> 6)] |= wbits << (x & 63);
+        }
+    }
+
+    tile_threshold_bits_scalar(src, s, tx, tw, im_max, im_min, min_white_black_diff,
+                               valid, value, wstride);
+}
+#endif
+
+#ifdef APRILTAG_THRESH_AVX2
+__attribute__((target("avx2")))
+static void tile_minmax_avx2(const uint8_t *buf, int s, int tw, uint8_t *im_max, uint8_t *im_min)
+{
+    const __m256i lowbyte = _mm256_set1_epi32(0xff);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int tx = 0;
+
+    // 16 tiles (64 pixels) per iteration.
+    for (; tx + 16 <= tw; tx += 16) {
+        const uint8_t *p = &buf[tx*4];
+        __m256i amax = _mm256_loadu_si256((const __m256i*) p);
+        __m256i bmax = _mm256_loadu_si256((const __m256i*) (p + 32));
+        __m256i amin = amax, bmin = bmax;
+
+        for (int dy = 1; dy < 4; dy++) {
+            __m256i a = _mm256_loadu_si256((const __m256i*) (p + dy*s));
+            __m256i b = _mm256_loadu_si256((const __m256i*) (p + dy*s + 32));
+            amax = _mm256_max_epu8(amax, a);
+            amin = _mm256_min_epu8(amin, a);
+            bmax = _mm256_max_epu8(bmax, b);
+            bmin = _mm256_min_epu8(bmin, b);
+        }
+
+        amax = _mm256_max_epu8(amax, _mm256_srli_epi32(amax, 8));
+        amax = _mm256_max_epu8(amax, _mm256_srli_epi32(amax, 16));
+        bmax = _mm256_max_epu8(bmax, _mm256_srli_epi32(bmax, 8));
+        bmax = _mm256_max_epu8(bmax, _mm256_srli_epi32(bmax, 16));
+        amin = _mm256_min_epu8(amin, _mm256_srli_epi32(amin, 8));
+        amin = _mm256_min_epu8(amin, _mm256_srli_epi32(amin, 16));
+        bmin = _mm256_min_epu8(bmin, _mm256_srli_epi32(bmin, 8));
+        bmin = _mm256_min_epu8(bmin, _mm256_srli_epi32(bmin, 16));
+
+        // the packs work within 128-bit lanes; the permute restores
+        // tile order with all maxima in the low half.
+        __m256i max16 = _mm256_packs_epi32(_mm256_and_si256(amax, lowbyte), _mm256_and_si256(bmax, lowbyte));
+        __m256i min16 = _mm256_packs_epi32(_mm256_and_si256(amin, lowbyte), _mm256_and_si256(bmin, lowbyte));
+        __m256i res = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(max16, min16), order);
+
+        _mm_storeu_si128((__m128i*) &im_max[tx], _mm256_castsi256_si128(res));
+        _mm_storeu_si128((__m128i*) &im_min[tx], _mm256_extracti128_si256(res, 1));
+    }
+
+    tile_minmax_sse2(buf + tx*4, s, tw - tx, im_max + tx, im_min + tx);
+}
+
+__attribute__((target("avx2")))
+static void tile_blur_avx2(const uint8_t *max_rows[3], const uint8_t *min_rows[3],
+                           int tw, uint8_t *out_max, uint8_t *out_min)
+{
+    tile_blur_scalar(max_rows, min_rows, 0, imin(1, tw), tw, out_max, out_min);
+
+    int tx = 1;
+    for (; tx + 32 + 1 <= tw; tx += 32) {
+        __m256i max = _mm256_setzero_si256();
+        __m256i min = _mm256_set1_epi8((char) 0xff);
+
+        for (int dy = 0; dy < 3; dy++) {
+            if (max_rows[dy] == NULL)
+                continue;
+            for (int dx = -1; dx <= 1; dx++) {
+                max = _mm256_max_epu8(max, _mm256_loadu_si256((const __m256i*) &max_rows[dy][tx + dx]));
+                min = _mm256_min_epu8(min, _mm256_loadu_si256((const __m256i*) &min_rows[dy][tx + dx]));
+            }
+        }
+
+        _mm256_storeu_si256((__m256i*) &out_max[tx], max);
+        _mm256_storeu_si256((__m256i*) &out_min[tx], min);
+    }
+
+    if (tx < tw)
+        tile_blur_scalar(max_rows, min_rows, tx, tw, tw, out_max, out_min);
+}
+
+__attribute__((target("avx2")))
+static void tile_threshold_avx2(const uint8_t *src, uint8_t *dst, int s, int tw,
+                                const uint8_t *im_max, const uint8_t *im_min,
+                                int min_white_black_diff)
+{
+    if (min_white_black_diff <= 0 || min_white_black_diff > 256) {
+        tile_threshold_scalar(src, dst, s, 0, tw, im_max, im_min, min_white_black_diff);
+        return;
+    }
+    const __m128i diffm1 = _mm_set1_epi8((char) (min_white_black_diff - 1));
+    const __m256i gray = _mm256_set1_epi8(127);
+    const __m256i ones = _mm256_set1_epi8((char) 0xff);
+
+    int tx = 0;
+    for (; tx + 8 <= tw; tx += 8) {
+        __m128i max = _mm_loadl_epi64((const __m128i*) &im_max[tx]);
+        __m128i min = _mm_loadl_epi64((const __m128i*) &im_min[tx]);
+        __m128i d = _mm_sub_epi8(max, min);
+        __m128i t = _mm_add_epi8(min, _mm_and_si128(_mm_srli_epi16(d, 1), _mm_set1_epi8(0x7f)));
+        __m128i l = _mm_cmpeq_epi8(_mm_min_epu8(d, diffm1), d);
+
+        t = _mm_unpacklo_epi8(t, t);
+        l = _mm_unpacklo_epi8(l, l);
+        __m256i thresh = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(t, t)),
+                                                 _mm_unpackhi_epi16(t, t), 1);
+        __m256i lowc = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(l, l)),
+                                               _mm_unpackhi_epi16(l, l), 1);
+
+        for (int dy = 0; dy < 4; dy++) {
+            __m256i v = _mm256_loadu_si256((const __m256i*) &src[dy*s + tx*4]);
+            __m256i le = _mm256_cmpeq_epi8(_mm256_max_epu8(v, thresh), thresh);
+            __m256i out = _mm256_andnot_si256(le, ones);
+            out = _mm256_or_si256(_mm256_and_si256(lowc, gray), _mm256_andnot_si256(lowc, out));
+            _mm256_storeu_si256((__m256i*) &dst[dy*s + tx*4], out);
+        }
+    }
+
+    tile_threshold_sse2(src + tx*4, dst + tx*4, s, tw - tx, im_max + tx, im_min + tx, min_white_black_diff);
+}
+
+__attribute__((target("avx2")))
+static void tile_threshold_bits_avx2(const uint8_t *src, int s, int tw,
+                                     const uint8_t *im_max, const uint8_t *im_min,
+                                     int min_white_black_diff,
+                                     uint64_t *valid, uint64_t *value, int wstride)
+{
+    if (min_white_black_diff <= 0 || min_white_black_diff > 256) {
+        tile_threshold_bits_scalar(src, s, 0, tw, im_max, im_min, min_white_black_diff,
+                                   valid, value, wstride);
+        return;
+    }
+    const __m128i diffm1 = _mm_set1_epi8((char) (min_white_black_diff - 1));
+
+    int tx = 0;
+    for (; tx + 8 <= tw; tx += 8) {
+        __m128i max = _mm_loadl_epi64((const __m128i*) &im_max[tx]);
+        __m128i min = _mm_loadl_epi64((const __m128i*) &im_min[tx]);
+        __m128i d = _mm_sub_epi8(max, min);
+        __m128i t = _mm_add_epi8(min, _mm_and_si128(_mm_srli_epi16(d, 1), _mm_set1_epi8(0x7f)));
+        __m128i l = _mm_cmpeq_epi8(_mm_min_epu8(d, diffm1), d);
+
+        // one bit per tile, replicated to the 4 pixels of the tile.
+        uint64_t vtiles = (uint64_t) (~_mm_movemask_epi8(l) & 0xff);
+        if (vtiles == 0)
+            continue;
+        uint64_t vbits = 0;
+        for (int i = 0; i < 8; i++) {
+            if (vtiles & (1 << i))
+                vbits |= ((uint64_t) 0xf) << (4*i);
+        }
+
+        t = _mm_unpacklo_epi8(t, t);
+        __m256i thresh = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(t, t)),
+                                                 _mm_unpackhi_epi16(t, t), 1);
+
+        int x = tx*4;
+        for (int dy = 0; dy < 4; dy++) {
+            __m256i v = _mm256_loadu_si256((const __m256i*) &src[dy*s + x]);
+            __m256i le = _mm256_cmpeq_epi8(_mm256_max_epu8(v, thresh), thresh);
+            uint64_t wbits = vbits & ~(uint64_t) (uint32_t) _mm256_movemask_epi8(le);
+
+            valid[dy*wstride + (x >> 6)] |= vbits << (x & 63);
+            value[dy*wstride + (x >> 6)] |= wbits << (x & 63);
+        }
+    }
+
+    tile_threshold_bits_sse2(src, s, tx, tw, im_max, im_min, min_white_black_diff,
+                             valid, value, wstride);
+}
+
+static bool cpu_has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+static void tile_minmax_row(const struct threshold_kernels *k, const uint8_t *buf, int s, int tw,
+                            uint8_t *im_max, uint8_t *im_min)
+{
+    switch (k->isa) {
+#ifdef APRILTAG_THRESH_AVX2
+        case THRESHOLD_ISA_AVX2:
+            tile_minmax_avx2(buf, s, tw, im_max, im_min);
+            return;
+#endif
+#ifdef APRILTAG_THRESH_SSE2
+        case THRESHOLD_ISA_SSE2:
+            tile_minmax_sse2(buf, s, tw, im_max, im_min);
+            return;
+#endif
+        default:
+            tile_minmax_scalar(buf, s, 0, tw, im_max, im_min);
+    }
+}
+
+static void tile_blur_row(const struct threshold_kernels *k, const uint8_t *max_rows[3], const uint8_t *min_rows[3],
+                          int tw, uint8_t *out_max, uint8_t *out_min)
+{
+    switch (k->isa) {
+#ifdef APRILTAG_THRESH_AVX2
+        case THRESHOLD_ISA_AVX2:
+            tile_blur_avx2(max_rows, min_rows, tw, out_max, out_min);
+            return;
+#endif
+#ifdef APRILTAG_THRESH_SSE2
+        case THRESHOLD_ISA_SSE2:
+            tile_blur_sse2(max_rows, min_rows, tw, out_max, out_min);
+            return;
+#endif
+        default:
+            tile_blur_scalar(max_rows, min_rows, 0, tw, tw, out_max, out_min);
+    }
+}
+
+static void tile_threshold_row(const struct threshold_kernels *k, const uint8_t *src, uint8_t *dst, int s, int tw,
+                               const uint8_t *im_max, const uint8_t *im_min, int min_white_black_diff)
+{
+    switch (k->isa) {
+#ifdef APRILTAG_THRESH_AVX2
+        case THRESHOLD_ISA_AVX2:
+            tile_threshold_avx2(src, dst, s, tw, im_max, im_min, min_white_black_diff);
+            return;
+#endif
+#ifdef APRILTAG_THRESH_SSE2
+        case THRESHOLD_ISA_SSE2:
+            tile_threshold_sse2(src, dst, s, tw, im_max, im_min, min_white_black_diff);
+            return;
+#endif
+        default:
+            tile_threshold_scalar(src, dst, s, 0, tw, im_max, im_min, min_white_black_diff);
+    }
+}
+
+static void tile_threshold_bits_row(const struct threshold_kernels *k, const uint8_t *src, int s, int tw,
+                                    const uint8_t *im_max, const uint8_t *im_min, int min_white_black_diff,
+                                    uint64_t *valid, uint64_t *value, int wstride)
+{
+    switch (k->isa) {
+#ifdef APRILTAG_THRESH_AVX2
+        case THRESHOLD_ISA_AVX2:
+            tile_threshold_bits_avx2(src, s, tw, im_max, im_min, min_white_black_diff,
+                                     valid, value, wstride);
+            return;
+#endif
+#ifdef APRILTAG_THRESH_SSE2
+        case THRESHOLD_ISA_SSE2:
+            tile_threshold_bits_sse2(src, s, 0, tw, im_max, im_min, min_white_black_diff,
+                                     valid, value, wstride);
+            return;
+#endif
+        default:
+            tile_threshold_bits_scalar(src, s, 0, tw, im_max, im_min, min_white_black_diff,
+                                       valid, value, wstride);
+    }
+}
+
+// pick the widest instruction set supported by this CPU.
+static void threshold_kernels_init(struct threshold_kernels *k)
+{
+    k->isa = THRESHOLD_ISA_SCALAR;
+#ifdef APRILTAG_THRESH_SSE2
+    k->isa = THRESHOLD_ISA_SSE2;
+#endif
+#ifdef APRILTAG_THRESH_AVX2
+    if (cpu_has_avx2())
+        k->isa = THRESHOLD_ISA_AVX2;
+#endif
+}
+
+void do_minmax_task(void *p)
+{
+    const int tilesz = 4;
+    struct minmax_task* task = (struct minmax_task*) p;
+    int s = task->im->stride;
+    int ty = task->ty;
+    int tw = task->im->width / tilesz;
+
+    tile_minmax_row(task->kernels, &task->im->buf[ty*tilesz*s], s, tw,
+                    &task->im_max[ty*tw], &task->im_min[ty*tw]);
+}
+
+void do_blur_task(void *p)
+{
+    const int tilesz = 4;
+    struct blur_task* task = (struct blur_task*) p;
+    int ty = task->ty;
+    int tw = task->im->width / tilesz;
+    int th = task->im->height / tilesz;
+    const uint8_t *max_rows[3], *min_rows[3];
+
+    for (int dy = -1; dy <= 1; dy++) {
+        bool inside = ty+dy >= 0 && ty+dy < th;
+        max_rows[dy+1] = inside ? &task->im_max[(ty+dy)*tw] : NULL;
+        min_rows[dy+1] = inside ? &task->im_min[(ty+dy)*tw] : NULL;
+    }
+
+    tile_blur_row(task->kernels, max_rows, min_rows, tw,
+                  &task->im_max_tmp[ty*tw], &task->im_min_tmp[ty*tw]);
+}
+
+void do_threshold_task(void *p)
+{
+    const int tilesz = 4;
+    struct threshold_task* task = (struct threshold_task*) p;
+    int ty = task->ty;
+    int tw = task->im->width / tilesz;
+    int s = task->im->stride;
+
+    tile_threshold_row(task->kernels, &task->im->buf[ty*tilesz*s], &task->threshim->buf[ty*tilesz*s], s, tw,
+                       &task->im_max[ty*tw], &task->im_min[ty*tw], task->td->qtp.min_white_black_diff);
+}
+
+// Threshold the pixels of the partial tiles along the right and bottom
+// edges, which use the (blurred) statistics of the nearest full tile.
+// If bits is non-NULL, it is written instead of threshim.
+static void threshold_edge_pixels(image_u8_t *im, image_u8_t *threshim, thresh_bits_t *bits,
+                                  int y0, int y1, int x0,
+                                  const uint8_t *im_max, const uint8_t *im_min, int tw)
+{
+    const int tilesz = 4;
+    int s = im->stride;
+
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < im->width; x++) {
+            int tx = x / tilesz;
+            if (tx >= tw)
+                tx = tw - 1;
+
+            int max = im_max[tx];
+            int min = im_min[tx];
+            int thresh = min + (max - min) / 2;
+
+            uint8_t v = im->buf[y*s+x];
+            if (bits) {
+                uint64_t bit = ((uint64_t) 1) << (x & 63);
+                bits->valid[y*bits->wstride + (x >> 6)] |= bit;
+                if (v > thresh)
+                    bits->value[y*bits->wstride + (x >> 6)] |= bit;
+            } else if (v > thresh)
+                threshim->buf[y*s+x] = 255;
+            else
+                threshim->buf[y*s+x] = 0;
+        }
+    }
+}
+
+// Computes tile extrema, the 3x3 tile dilation/erosion and the final
+// binarization for the tile rows [ty0, ty1) in one pass. Only a rolling
+// window of three rows of tile statistics is kept, so the working set
+// stays in cache. The tile rows just outside the band are recomputed
+// rather than shared with the neighboring bands.
+static void do_threshold_band_task(void *p)
+{
+    const int tilesz = 4;
+    struct threshold_band_task *task = (struct threshold_band_task*) p;
+    image_u8_t *im = task->im;
+    image_u8_t *threshim = task->threshim;
+    thresh_bits_t *bits = task->bits;
+    int s = im->stride;
+    int tw = im->width / tilesz;
+    int th = im->height / tilesz;
+    int min_white_black_diff = task->td->qtp.min_white_black_diff;
+
+    uint8_t *ring_max[3], *ring_min[3];
+    for (int i = 0; i < 3; i++) {
+        ring_max[i] = &task->window[(2*i)*tw];
+        ring_min[i] = &task->window[(2*i+1)*tw];
+    }
+    uint8_t *blur_max = &task->window[6*tw];
+    uint8_t *blur_min = &task->window[7*tw];
+
+    for (int ty = imax(0, task->ty0 - 1); ty < imin(th, task->ty0 + 1); ty++)
+        tile_minmax_row(task->kernels, &im->buf[ty*tilesz*s], s, tw, ring_max[ty % 3], ring_min[ty % 3]);
+
+    for (int ty = task->ty0; ty < task->ty1; ty++) {
+        if (ty + 1 < th)
+            tile_minmax_row(task->kernels, &im->buf[(ty+1)*tilesz*s], s, tw,
+                            ring_max[(ty+1) % 3], ring_min[(ty+1) % 3]);
+
+        const uint8_t *max_rows[3], *min_rows[3];
+        for (int dy = -1; dy <= 1; dy++) {
+            bool inside = ty+dy >= 0 && ty+dy < th;
+            max_rows[dy+1] = inside ? ring_max[(ty+dy) % 3] : NULL;
+            min_rows[dy+1] = inside ? ring_min[(ty+dy) % 3] : NULL;
+        }
+        tile_blur_row(task->kernels, max_rows, min_rows, tw, blur_max, blur_min);
+
+        if (bits)
+            tile_threshold_bits_row(task->kernels, &im->buf[ty*tilesz*s], s, tw,
+                                    blur_max, blur_min, min_white_black_diff,
+                                    &bits->valid[ty*tilesz*bits->wstride],
+                                    &bits->value[ty*tilesz*bits->wstride], bits->wstride);
+        else
+            tile_threshold_row(task->kernels, &im->buf[ty*tilesz*s], &threshim->buf[ty*tilesz*s], s, tw,
+                               blur_max, blur_min, min_white_black_diff);
+
+        threshold_edge_pixels(im, threshim, bits, ty*tilesz, (ty+1)*tilesz, tw*tilesz, blur_max, blur_min, tw);
+        if (ty == th - 1)
+            threshold_edge_pixels(im, threshim, bits, th*tilesz, im->height, 0, blur_max, blur_min, tw);
+    }
+}
+
+// Runs do_threshold_band_task() over the whole image, writing either
+// threshim or (if non-NULL) bits.
+static void threshold_bands(apriltag_detector_t *td, image_u8_t *im, image_u8_t *threshim,
+                            thresh_bits_t *bits, const struct threshold_kernels *kernels)
+{
+    const int tilesz = 4;
+    int tw = im->width / tilesz;
+    int th = im->height / tilesz;
+
+    // Bands should be tall enough that the two recomputed rows of
+    // tile statistics at their edges are a small overhead.
+    int nbands = imax(1, imin(APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads, th / 8));
+    int bandsz = (th + nbands - 1) / imax(1, nbands);
+
+    struct threshold_band_task *band_tasks = arena_alloc(td->frame_arena, sizeof(struct threshold_band_task)*nbands);
+    uint8_t *windows = arena_alloc(td->frame_arena, 8*tw*nbands + 1);
+
+    int ntasks = 0;
+    for (int ty = 0; ty < th; ty += bandsz) {
+        band_tasks[ntasks].ty0 = ty;
+        band_tasks[ntasks].ty1 = imin(th, ty + bandsz);
+        band_tasks[ntasks].kernels = kernels;
+        band_tasks[ntasks].td = td;
+        band_tasks[ntasks].im = im;
+        band_tasks[ntasks].threshim = threshim;
+        band_tasks[ntasks].bits = bits;
+        band_tasks[ntasks].window = &windows[8*tw*ntasks];
+
+        workerpool_add_task(td->wp, do_threshold_band_task, &band_tasks[ntasks]);
+        ntasks++;
+    }
+    workerpool_run(td->wp);
+}
+
+image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
+{
+    int w = im->width, h = im->height, s = im->stride;
+    assert(w < 32768);
+    assert(h < 32768);
+
+    image_u8_t *threshim = image_u8_create_alignment(w, h, s);
+    assert(threshim->stride == s);
+
+    // The idea is to find the maximum and minimum values in a
+    // window around each pixel. If it's a contrast-free region
+    // (max-min is small), don't try to binarize. Otherwise,
+    // threshold according to (max+min)/2.
+    //
+    // Mark low-contrast regions with value 127 so that we can skip
+    // future work on these areas too.
+
+    // however, computing max/min around every pixel is needlessly
+    // expensive. We compute max/min for tiles. To avoid artifacts
+    // that arise when high-contrast features appear near a tile
+    // edge (and thus moving from one tile to another results in a
+    // large change in max/min value), the max/min values used for
+    // any pixel are computed from all 3x3 surrounding tiles. Thus,
+    // the max/min sampling area for nearby pixels overlap by at least
+    // one tile.
+    //
+    // The important thing is that the windows be large enough to
+    // capture edge transitions; the tag does not need to fit into
+    // a tile.
+
+    // XXX Tunable. Generally, small tile sizes--- so long as they're
+    // large enough to span a single tag edge--- seem to be a winner.
+    const int tilesz = 4;
+
+    // the last (possibly partial) tiles along each row and column will
+    // just use the min/max value from the last full tile.
+    int tw = w / tilesz;
+    int th = h / tilesz;
+
+    struct threshold_kernels kernels;
+    threshold_kernels_init(&kernels);
+
+    if (td->qtp.fused_threshold) {
+        threshold_bands(td, im, threshim, NULL, &kernels);
+        goto deglitch;
+    }
+
+    uint8_t *im_max = arena_calloc(td->frame_arena, tw*th, sizeof(uint8_t));
+    uint8_t *im_min = arena_calloc(td->frame_arena, tw*th, sizeof(uint8_t));
+
+    struct minmax_task *minmax_tasks = arena_alloc(td->frame_arena, sizeof(struct minmax_task)*th);
+    // first, collect min/max statistics for each tile
+    for (int ty = 0; ty < th; ty++) {
+        minmax_tasks[ty].im = im;
+        minmax_tasks[ty].im_max = im_max;
+        minmax_tasks[ty].im_min = im_min;
         minmax_tasks[ty].ty = ty;
+        minmax_tasks[ty].kernels = &kernels;
 
         workerpool_add_task(td->wp, do_minmax_task, &minmax_tasks[ty]);
     }
     workerpool_run(td->wp);
-    free(minmax_tasks);
 
     // second, apply 3x3 max/min convolution to "blur" these values
     // over larger areas. This reduces artifacts due to abrupt changes
     // in the threshold value.
     if (1) {
-        uint8_t *im_max_tmp = calloc(tw*th, sizeof(uint8_t));
-        uint8_t *im_min_tmp = calloc(tw*th, sizeof(uint8_t));
+        uint8_t *im_max_tmp = arena_calloc(td->frame_arena, tw*th, sizeof(uint8_t));
+        uint8_t *im_min_tmp = arena_calloc(td->frame_arena, tw*th, sizeof(uint8_t));
 
-        struct blur_task *blur_tasks = malloc(sizeof(struct blur_task)*th);
+        struct blur_task *blur_tasks = arena_alloc(td->frame_arena, sizeof(struct blur_task)*th);
         for (int ty = 0; ty < th; ty++) {
             blur_tasks[ty].im = im;
             blur_tasks[ty].im_max = im_max;
@@ -1270,18 +2209,16 @@ image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
             blur_tasks[ty].im_max_tmp = im_max_tmp;
             blur_tasks[ty].im_min_tmp = im_min_tmp;
             blur_tasks[ty].ty = ty;
+            blur_tasks[ty].kernels = &kernels;
 
             workerpool_add_task(td->wp, do_blur_task, &blur_tasks[ty]);
         }
         workerpool_run(td->wp);
-        free(blur_tasks);
-        free(im_max);
-        free(im_min);
         im_max = im_max_tmp;
         im_min = im_min_tmp;
     }
 
-    struct threshold_task *threshold_tasks = malloc(sizeof(struct threshold_task)*th);
+    struct threshold_task *threshold_tasks = arena_alloc(td->frame_arena, sizeof(struct threshold_task)*th);
     for (int ty = 0; ty < th; ty++) {
         threshold_tasks[ty].im = im;
         threshold_tasks[ty].threshim = threshim;
@@ -1289,11 +2226,11 @@ image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
         threshold_tasks[ty].im_min = im_min;
         threshold_tasks[ty].ty = ty;
         threshold_tasks[ty].td = td;
+        threshold_tasks[ty].kernels = &kernels;
 
         workerpool_add_task(td->wp, do_threshold_task, &threshold_tasks[ty]);
     }
     workerpool_run(td->wp);
-    free(threshold_tasks);
 
     // we skipped over the non-full-sized tiles above. Fix those now.
     if (1) {
@@ -1332,9 +2269,7 @@ image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
         }
     }
 
-    free(im_min);
-    free(im_max);
-
+  deglitch:
     // this is a dilate/erode deglitching scheme that does not improve
     // anything as far as I can tell.
     if (td->qtp.deglitch) {
@@ -1376,6 +2311,86 @@ image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
     return threshim;
 }
 
+static thresh_bits_t *thresh_bits_create(int width, int height)
+{
+    thresh_bits_t *bits = malloc(sizeof(thresh_bits_t));
+    bits->width = width;
+    bits->height = height;
+    bits->wstride = (width + 63) / 64;
+    bits->valid = calloc((size_t) bits->wstride*height, sizeof(uint64_t));
+    bits->value = calloc((size_t) bits->wstride*height, sizeof(uint64_t));
+    return bits;
+}
+
+static void thresh_bits_destroy(thresh_bits_t *bits)
+{
+    free(bits->valid);
+    free(bits->value);
+    free(bits);
+}
+
+// Convert between the packed and the byte (0, 127, 255) representations.
+static thresh_bits_t *thresh_bits_from_image(image_u8_t *threshim)
+{
+    thresh_bits_t *bits = thresh_bits_create(threshim->width, threshim->height);
+
+    for (int y = 0; y < threshim->height; y++) {
+        for (int x = 0; x < threshim->width; x++) {
+            uint8_t v = threshim->buf[y*threshim->stride + x];
+            uint64_t bit = ((uint64_t) 1) << (x & 63);
+            if (v != 127)
+                bits->valid[y*bits->wstride + (x >> 6)] |= bit;
+            if (v == 255)
+                bits->value[y*bits->wstride + (x >> 6)] |= bit;
+        }
+    }
+    return bits;
+}
+
+static image_u8_t *thresh_bits_to_image(thresh_bits_t *bits)
+{
+    image_u8_t *threshim = image_u8_create(bits->width, bits->height);
+
+    for (int y = 0; y < bits->height; y++) {
+        for (int x = 0; x < bits->width; x++) {
+            uint64_t bit = ((uint64_t) 1) << (x & 63);
+            uint8_t v = 127;
+            if (bits->valid[y*bits->wstride + (x >> 6)] & bit)
+                v = (bits->value[y*bits->wstride + (x >> 6)] & bit) ? 255 : 0;
+            threshim->buf[y*threshim->stride + x] = v;
+        }
+    }
+    return threshim;
+}
+
+// Same as threshold(), but produces the packed image. The band tasks
+// write the bitplanes directly; the byte image is only materialized
+// when deglitching, which is not implemented on the packed form.
+thresh_bits_t *threshold_bits(apriltag_detector_t *td, image_u8_t *im)
+{
+    if (td->qtp.deglitch) {
+        // threshold() makes its own timeprofile stamp.
+        image_u8_t *threshim = threshold(td, im);
+        thresh_bits_t *bits = thresh_bits_from_image(threshim);
+        image_u8_destroy(threshim);
+        return bits;
+    }
+
+    assert(im->width < 32768);
+    assert(im->height < 32768);
+
+    thresh_bits_t *bits = thresh_bits_create(im->width, im->height);
+
+    struct threshold_kernels kernels;
+    threshold_kernels_init(&kernels);
+
+    threshold_bands(td, im, NULL, bits, &kernels);
+
+    timeprofile_stamp(td->tp, "threshold");
+
+    return bits;
+}
+
 // basically the same as threshold(), but assumes the input image is a
 // bayer image. It collects statistics separately for each 2x2 block
 // of pixels. NOT WELL TESTED.
@@ -1454,104 +2469,625 @@ image_u8_t *threshold_bayer(apriltag_detector_t *td, image_u8_t *im)
                 }
             }
 
-            // XXX CONSTANT
-//            if (max - min < 30)
-//                continue;
+            // XXX CONSTANT
+//            if (max - min < 30)
+//                continue;
+
+            // argument for biasing towards dark: specular highlights
+            // can be substantially brighter than white tag parts
+            uint8_t thresh[4];
+            for (int i = 0; i < 4; i++) {
+                thresh[i] = min[i] + (max[i] - min[i]) / 2;
+            }
+
+            for (int dy = 0; dy < tilesz; dy++) {
+                int y = ty*tilesz + dy;
+                if (y >= h)
+                    continue;
+
+                for (int dx = 0; dx < tilesz; dx++) {
+                    int x = tx*tilesz + dx;
+                    if (x >= w)
+                        continue;
+
+                    // which bayer element is this pixel?
+                    int idx = (2*(y&1) + (x&1));
+
+                    uint8_t v = im->buf[y*s+x];
+                    threshim->buf[y*s+x] = v > thresh[idx];
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < 4; i++) {
+        free(im_min[i]);
+        free(im_max[i]);
+    }
+
+    timeprofile_stamp(td->tp, "threshold");
+
+    return threshim;
+}
+
+// If bits is non-NULL, it is used instead of threshim.
+static unionfind_t* connected_components_impl(apriltag_detector_t *td, image_u8_t* threshim, thresh_bits_t *bits,
+                                              int w, int h, int ts) {
+    unionfind_t *uf = unionfind_create(w * h);
+
+    if (td->nthreads <= 1) {
+        if (bits) {
+            do_unionfind_first_line_bits(uf, false, bits);
+            for (int y = 1; y < h; y++) {
+                do_unionfind_line_bits(uf, false, bits, y);
+            }
+        } else {
+            do_unionfind_first_line(uf, false, threshim, w, ts);
+            for (int y = 1; y < h; y++) {
+                do_unionfind_line2(uf, false, threshim, w, ts, y);
+            }
+        }
+    } else {
+        int sz = h;
+        int chunksize = 1 + sz / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
+        struct unionfind_task *tasks = arena_alloc(td->frame_arena, sizeof(struct unionfind_task)*(sz / chunksize + 1));
+
+        int ntasks = 0;
+
+        for (int i = 0; i < sz; i += chunksize) {
+            // each task will process [y0, y1). Note that this attaches
+            // each cell to the cells above it, so row y0-1 is touched
+            // too; the concurrent union-find makes that safe, and no
+            // rows need to be stitched together afterwards.
+            tasks[ntasks].y0 = i;
+            tasks[ntasks].y1 = imin(sz, i + chunksize);
+            tasks[ntasks].h = h;
+            tasks[ntasks].w = w;
+            tasks[ntasks].s = ts;
+            tasks[ntasks].uf = uf;
+            tasks[ntasks].im = threshim;
+            tasks[ntasks].bits = bits;
+            tasks[ntasks].runs = NULL;
+
+            workerpool_add_task(td->wp, do_unionfind_task2, &tasks[ntasks]);
+            ntasks++;
+        }
+
+        workerpool_run(td->wp);
+
+        unionfind_count_sizes_parallel(td, uf, w * h);
+    }
+    return uf;
+}
+
+unionfind_t* connected_components(apriltag_detector_t *td, image_u8_t* threshim, int w, int h, int ts) {
+    return connected_components_impl(td, threshim, NULL, w, h, ts);
+}
+
+static int ccl_row_runs(const uint8_t *row, int w, struct ccl_run *runs)
+{
+    int n = 0;
+
+    for (int x = 0; x < w - 1; ) {
+        int x0 = x;
+        uint8_t v = row[x];
+        while (x < w - 1 && row[x] == v)
+            x++;
+        if (v != 127)
+            runs[n++] = (struct ccl_run) { .x0 = x0, .x1 = x, .v = v };
+    }
+
+    if (row[w-1] != 127)
+        runs[n++] = (struct ccl_run) { .x0 = w - 1, .x1 = w, .v = row[w-1] };
+
+    return n;
+}
+
+// A run starts at x = 0, at x = w-1, and at every pixel that differs
+// from its left neighbor.
+static int ccl_row_runs_bits(const uint64_t *V, const uint64_t *U, int w, int ws, struct ccl_run *runs)
+{
+    int n = 0;
+    int x0 = 0;
+
+    for (int k = 0; k <= ws; k++) {
+        uint64_t starts;
+        if (k < ws) {
+            starts = ((V[k] ^ bits_left(V, k)) | (U[k] ^ bits_left(U, k))) & bits_span(k, 1, w);
+            starts |= bits_span(k, imax(w - 1, 1), w);
+        } else {
+            starts = 1; // the end of the row.
+        }
+
+        while (starts) {
+            int x = imin(w, 64*k + ctz64(starts));
+            starts &= starts - 1;
+
+            uint64_t bit = ((uint64_t) 1) << (x0 & 63);
+            if (V[x0 >> 6] & bit)
+                runs[n++] = (struct ccl_run) { .x0 = x0, .x1 = x, .v = (U[x0 >> 6] & bit) ? 255 : 0 };
+            x0 = x;
+        }
+    }
+
+    return n;
+}
+
+static void do_run_task(void *p)
+{
+    struct run_task *task = (struct run_task*) p;
+    ccl_runs_t *cr = task->cr;
+    int w = cr->w;
+
+    for (int y = task->y0; y < task->y1; y++) {
+        if (task->nruns + w > task->alloc) {
+            task->alloc = imax(2*task->alloc, task->nruns + w);
+            task->runs = realloc(task->runs, sizeof(struct ccl_run)*task->alloc);
+        }
+
+        int n;
+        if (task->bits) {
+            int ws = task->bits->wstride;
+            n = ccl_row_runs_bits(&task->bits->valid[y*ws], &task->bits->value[y*ws], w, ws,
+                                  &task->runs[task->nruns]);
+        } else {
+            n = ccl_row_runs(&task->im->buf[y*task->im->stride], w, &task->runs[task->nruns]);
+        }
+
+        cr->row_start[y+1] = n;
+        task->nruns += n;
+    }
+}
+
+// Connects the runs of row y with those of row y-1. The runs of both
+// rows are sorted, so this is a merge.
+static void ccl_runs_union_line(ccl_runs_t *cr, bool concurrent, int y)
+{
+    assert(y > 0);
+
+    const struct ccl_run *runs = cr->runs;
+    int w = cr->w;
+    uint32_t b = cr->row_start[y-1], bend = cr->row_start[y];
+
+    for (uint32_t a = cr->row_start[y]; a < cr->row_start[y+1]; a++) {
+        // the pixels of this run that connect upwards, widened by the
+        // diagonal connections of white pixels.
+        int lo = imax(runs[a].x0, 1);
+        int hi = imin(runs[a].x1 - 1, w - 2);
+        if (lo > hi)
+            continue;
+        if (runs[a].v == 255) {
+            lo--;
+            hi++;
+        }
+
+        while (b < bend && runs[b].x1 <= lo)
+            b++;
+
+        for (uint32_t j = b; j < bend && runs[j].x0 <= hi; j++) {
+            if (runs[j].v != runs[a].v)
+                continue;
+
+            // do_unionfind_line2() skips the diagonal connection to
+            // (x+1, y-1) when (x, y-1) has the same value, as the two
+            // would normally be connected already. That does not hold
+            // for the last column, which is then left unconnected.
+            if (runs[j].x0 == w - 1 && j > cr->row_start[y-1] &&
+                runs[j-1].x1 == w - 1 && runs[j-1].v == runs[j].v)
+                continue;
+
+            ccl_connect(cr->uf, concurrent, a, j);
+        }
+    }
+}
+
+static void do_run_union_task(void *p)
+{
+    struct unionfind_task *task = (struct unionfind_task*) p;
+    for (int y = imax(task->y0, 1); y < task->y1; y++)
+        ccl_runs_union_line(task->runs, true, y);
+}
+
+static void ccl_runs_destroy(ccl_runs_t *cr)
+{
+    unionfind_destroy(cr->uf);
+    free(cr);
+}
+
+// If bits is non-NULL, it is used instead of threshim.
+static ccl_runs_t *connected_components_runs(apriltag_detector_t *td, image_u8_t* threshim, thresh_bits_t *bits,
+                                             int w, int h) {
+    ccl_runs_t *cr = calloc(1, sizeof(ccl_runs_t));
+    cr->w = w;
+    cr->h = h;
+    cr->row_start = arena_calloc(td->frame_arena, h + 1, sizeof(uint32_t));
+
+    // find the runs of each row in parallel, then concatenate them.
+    int chunksize = 1 + h / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
+    struct run_task *run_tasks = arena_calloc(td->frame_arena, h / chunksize + 1, sizeof(struct run_task));
+
+    int nrun_tasks = 0;
+    for (int i = 0; i < h; i += chunksize) {
+        run_tasks[nrun_tasks].y0 = i;
+        run_tasks[nrun_tasks].y1 = imin(h, i + chunksize);
+        run_tasks[nrun_tasks].im = threshim;
+        run_tasks[nrun_tasks].bits = bits;
+        run_tasks[nrun_tasks].cr = cr;
+
+        workerpool_add_task(td->wp, do_run_task, &run_tasks[nrun_tasks]);
+        nrun_tasks++;
+    }
+    workerpool_run(td->wp);
+
+    for (int y = 0; y < h; y++)
+        cr->row_start[y+1] += cr->row_start[y];
+    cr->nruns = cr->row_start[h];
+
+    cr->runs = arena_alloc(td->frame_arena, sizeof(struct ccl_run)*cr->nruns + 1);
+    cr->uf = unionfind_create(cr->nruns);
+
+    for (int i = 0; i < nrun_tasks; i++) {
+        uint32_t r0 = cr->row_start[run_tasks[i].y0];
+        memcpy(&cr->runs[r0], run_tasks[i].runs, sizeof(struct ccl_run)*run_tasks[i].nruns);
+        free(run_tasks[i].runs);
+
+        for (int j = 0; j < run_tasks[i].nruns; j++)
+            unionfind_set_weight(cr->uf, r0 + j, cr->runs[r0 + j].x1 - cr->runs[r0 + j].x0);
+    }
+
+    // now connect the runs, in the same way as connected_components_impl().
+    if (td->nthreads <= 1) {
+        for (int y = 1; y < h; y++)
+            ccl_runs_union_line(cr, false, y);
+    } else {
+        int sz = h;
+        chunksize = 1 + sz / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
+        struct unionfind_task *tasks = arena_alloc(td->frame_arena, sizeof(struct unionfind_task)*(sz / chunksize + 1));
+
+        int ntasks = 0;
+        for (int i = 0; i < sz; i += chunksize) {
+            tasks[ntasks].y0 = i;
+            tasks[ntasks].y1 = imin(sz, i + chunksize);
+            tasks[ntasks].runs = cr;
+
+            workerpool_add_task(td->wp, do_run_union_task, &tasks[ntasks]);
+            ntasks++;
+        }
+
+        workerpool_run(td->wp);
+
+        unionfind_count_sizes_parallel(td, cr->uf, cr->nruns);
+    }
+
+    return cr;
+}
+
+// A per-task hash map from cluster id (the pair of representatives of
+// the two adjacent components) to the points of the cluster. If pts is
+// non-NULL, the points are instead appended to it with their cluster
+// keys, to be sorted later.
+struct cluster_map
+{
+    struct cluster_pts *pts;
+    bool merge_points;
+
+    int nclustermap;
+    struct uint64_zarray_entry **clustermap;
+
+    int mem_chunk_size;
+    struct uint64_zarray_entry **mem_pools;
+    int mem_pool_idx;
+    int mem_pool_loc;
+};
+
+static void cluster_pts_grow_table(struct cluster_pts *cp)
+{
+    cp->table_size = cp->table_size ? 2*cp->table_size : 256;
+    free(cp->table);
+    cp->table = calloc(cp->table_size, sizeof(uint32_t));
+
+    uint32_t mask = cp->table_size - 1;
+    for (int i = 0; i < cp->nclusters; i++) {
+        uint32_t bucket = u64hash_2(cp->ids[i]) & mask;
+        while (cp->table[bucket])
+            bucket = (bucket + 1) & mask;
+        cp->table[bucket] = i + 1;
+    }
+}
+
+static inline uint32_t cluster_pts_index(struct cluster_pts *cp, uint64_t clusterid)
+{
+    uint32_t mask = cp->table_size - 1;
+    uint32_t bucket = u64hash_2(clusterid) & mask;
+    while (cp->table[bucket]) {
+        uint32_t cidx = cp->table[bucket] - 1;
+        if (cp->ids[cidx] == clusterid)
+            return cidx;
+        bucket = (bucket + 1) & mask;
+    }
+
+    // a new cluster. Keep the table at most half full.
+    if (cp->nclusters == cp->clusters_alloc) {
+        cp->clusters_alloc = cp->clusters_alloc ? 2*cp->clusters_alloc : 64;
+        cp->ids = realloc(cp->ids, sizeof(uint64_t)*cp->clusters_alloc);
+        cp->counts = realloc(cp->counts, sizeof(uint32_t)*cp->clusters_alloc);
+        cp->last_pixel = realloc(cp->last_pixel, sizeof(uint32_t)*cp->clusters_alloc);
+        cp->last_pt = realloc(cp->last_pt, sizeof(uint32_t)*cp->clusters_alloc);
+    }
 
-            // argument for biasing towards dark: specular highlights
-            // can be substantially brighter than white tag parts
-            uint8_t thresh[4];
-            for (int i = 0; i < 4; i++) {
-                thresh[i] = min[i] + (max[i] - min[i]) / 2;
-            }
+    uint32_t cidx = cp->nclusters++;
+    cp->ids[cidx] = clusterid;
+    cp->counts[cidx] = 0;
+    cp->last_pixel[cidx] = 0xffffffff;
 
-            for (int dy = 0; dy < tilesz; dy++) {
-                int y = ty*tilesz + dy;
-                if (y >= h)
-                    continue;
+    if (2*cp->nclusters > cp->table_size)
+        cluster_pts_grow_table(cp);
+    else
+        cp->table[bucket] = cidx + 1;
 
-                for (int dx = 0; dx < tilesz; dx++) {
-                    int x = tx*tilesz + dx;
-                    if (x >= w)
-                        continue;
+    return cidx;
+}
 
-                    // which bayer element is this pixel?
-                    int idx = (2*(y&1) + (x&1));
+// see cluster_map_connect() for merge.
+static inline void cluster_pts_add(struct cluster_pts *cp, uint64_t clusterid, struct pt *p,
+                                   uint32_t pixel, bool merge)
+{
+    uint32_t cidx = cluster_pts_index(cp, clusterid);
+    if (merge && cp->last_pixel[cidx] == pixel) {
+        struct cluster_pt *cpt = &cp->data[cp->last_pt[cidx]];
+        cpt->gx += p->gx;
+        cpt->gy += p->gy;
+        return;
+    }
 
-                    uint8_t v = im->buf[y*s+x];
-                    threshim->buf[y*s+x] = v > thresh[idx];
-                }
-            }
-        }
+    cp->last_pixel[cidx] = pixel;
+    cp->last_pt[cidx] = cp->size;
+    cp->counts[cidx]++;
+
+    if (cp->size == cp->alloc) {
+        cp->alloc = cp->alloc ? 2*cp->alloc : 1024;
+        cp->data = realloc(cp->data, sizeof(struct cluster_pt)*cp->alloc);
     }
+    struct cluster_pt *cpt = &cp->data[cp->size++];
+    cpt->cidx = cidx;
+    cpt->x = p->x;
+    cpt->y = p->y;
+    cpt->gx = p->gx;
+    cpt->gy = p->gy;
+}
 
-    for (int i = 0; i < 4; i++) {
-        free(im_min[i]);
-        free(im_max[i]);
+static void cluster_pts_free(struct cluster_pts *cp)
+{
+    free(cp->data);
+    free(cp->ids);
+    free(cp->counts);
+    free(cp->last_pixel);
+    free(cp->last_pt);
+    free(cp->table);
+    memset(cp, 0, sizeof(struct cluster_pts));
+}
+
+static void cluster_map_init(struct cluster_map *cm, int nclustermap, struct cluster_pts *pts, bool merge_points)
+{
+    cm->pts = pts;
+    cm->merge_points = merge_points;
+    if (pts) {
+        cluster_pts_grow_table(pts);
+        return;
     }
 
-    timeprofile_stamp(td->tp, "threshold");
+    cm->nclustermap = nclustermap;
+    cm->clustermap = calloc(nclustermap, sizeof(struct uint64_zarray_entry*));
 
-    return threshim;
+    cm->mem_chunk_size = 2048;
+    cm->mem_pools = malloc(sizeof(struct uint64_zarray_entry *)*(1 + 2 * nclustermap / cm->mem_chunk_size)); // SmodeTech: avoid memory corruption when nclustermap < mem_chunk_size
+    cm->mem_pool_idx = 0;
+    cm->mem_pool_loc = 0;
+    cm->mem_pools[cm->mem_pool_idx] = calloc(cm->mem_chunk_size, sizeof(struct uint64_zarray_entry));
 }
 
-unionfind_t* connected_components(apriltag_detector_t *td, image_u8_t* threshim, int w, int h, int ts) {
-    unionfind_t *uf = unionfind_create(w * h);
+// Answers the gradient clustering's queries about the component of a
+// pixel, either from the per-pixel union-find or from the union-find
+// over runs. In the latter case the representatives of rows y and y+1
+// are expanded into label rows as the scan moves down the image.
+struct ccl_lookup
+{
+    unionfind_t *uf;
+    int w, h;
 
-    if (td->nthreads <= 1) {
-        do_unionfind_first_line(uf, threshim, w, ts);
-        for (int y = 1; y < h; y++) {
-            do_unionfind_line2(uf, threshim, w, ts, y);
-        }
+    ccl_runs_t *runs; // if non-NULL, uf is runs->uf.
+    int y;
+    uint32_t *labels[2];
+    uint32_t *label_buf;
+};
+
+static void ccl_lookup_init(struct ccl_lookup *cl, unionfind_t *uf, ccl_runs_t *runs, int w, int h)
+{
+    cl->uf = runs ? runs->uf : uf;
+    cl->w = w;
+    cl->h = h;
+    cl->runs = runs;
+    cl->y = -2;
+    cl->label_buf = NULL;
+    if (runs)
+        cl->label_buf = malloc(sizeof(uint32_t)*2*w);
+    cl->labels[0] = cl->label_buf;
+    cl->labels[1] = cl->label_buf + (runs ? w : 0);
+}
+
+static void ccl_lookup_destroy(struct ccl_lookup *cl)
+{
+    free(cl->label_buf);
+}
+
+static void ccl_lookup_fill(struct ccl_lookup *cl, int y, uint32_t *labels)
+{
+    ccl_runs_t *cr = cl->runs;
+    if (y >= cl->h)
+        return;
+
+    for (uint32_t r = cr->row_start[y]; r < cr->row_start[y+1]; r++) {
+        uint32_t rep = unionfind_get_representative(cr->uf, r);
+        for (int x = cr->runs[r].x0; x < cr->runs[r].x1; x++)
+            labels[x] = rep;
+    }
+}
+
+// must be called before querying pixels of rows y and y+1.
+static void ccl_lookup_row(struct ccl_lookup *cl, int y)
+{
+    if (!cl->runs || y == cl->y)
+        return;
+
+    if (y == cl->y + 1) {
+        uint32_t *tmp = cl->labels[0];
+        cl->labels[0] = cl->labels[1];
+        cl->labels[1] = tmp;
     } else {
-        do_unionfind_first_line(uf, threshim, w, ts);
+        ccl_lookup_fill(cl, y, cl->labels[0]);
+    }
+    ccl_lookup_fill(cl, y + 1, cl->labels[1]);
+    cl->y = y;
+}
 
-        int sz = h;
-        int chunksize = 1 + sz / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
-        struct unionfind_task *tasks = malloc(sizeof(struct unionfind_task)*(sz / chunksize + 1));
+// the pixel must be binarized (not 127).
+static inline uint32_t ccl_lookup_rep(struct ccl_lookup *cl, int x, int y)
+{
+    if (cl->runs)
+        return cl->labels[y - cl->y][x];
+    return unionfind_get_representative(cl->uf, y*cl->w + x);
+}
 
-        int ntasks = 0;
+static inline uint32_t ccl_lookup_size(struct ccl_lookup *cl, uint32_t rep)
+{
+    return unionfind_get_set_size(cl->uf, rep);
+}
 
-        for (int i = 1; i < sz; i += chunksize) {
-            // each task will process [y0, y1). Note that this attaches
-            // each cell to the right and down, so row y1 *is* potentially modified.
-            //
-            // for parallelization, make sure that each task doesn't touch rows
-            // used by another thread.
-            tasks[ntasks].y0 = i;
-            tasks[ntasks].y1 = imin(sz, i + chunksize - 1);
-            tasks[ntasks].h = h;
-            tasks[ntasks].w = w;
-            tasks[ntasks].s = ts;
-            tasks[ntasks].uf = uf;
-            tasks[ntasks].im = threshim;
+// whenever we find two adjacent pixels such that one is white and the
+// other black, we add the point half-way between them to a cluster
+// associated with the unique ids of the white and black regions.
+//
+// We additionally compute the gradient direction (i.e., which
+// direction was the white pixel?) Note: if (v1-v0) == 255, then
+// (dx,dy) points towards the white pixel. if (v1-v0) == -255, then
+// (dx,dy) points towards the black pixel. p.gx and p.gy will thus
+// be -255, 0, or 255.
+//
+// A pixel next to several pixels of the other component adds a point
+// for each of them. If cm->merge_points is set, only the first of
+// those points is kept, and the gradients of the others are added to
+// it, so that each boundary pixel counts once.
+//
+// Returns false (and adds nothing) if the neighboring component is
+// too small.
+static inline bool cluster_map_connect(struct cluster_map *cm, struct ccl_lookup *cl,
+                                       int x, int y, int dx, int dy, uint64_t rep0, int v0, int v1)
+{
+    uint64_t rep1 = ccl_lookup_rep(cl, x + dx, y + dy);
+    if (ccl_lookup_size(cl, rep1) <= 24)
+        return false;
+
+    uint64_t clusterid;
+    if (rep0 < rep1)
+        clusterid = (rep1 << 32) + rep0;
+    else
+        clusterid = (rep0 << 32) + rep1;
+
+    struct pt p = { .x = 2*x + dx, .y = 2*y + dy, .gx = dx*(v1-v0), .gy = dy*(v1-v0)};
+    uint32_t pixel = y*cl->w + x;
+
+    if (cm->pts) {
+        cluster_pts_add(cm->pts, clusterid, &p, pixel, cm->merge_points);
+        return true;
+    }
 
-            workerpool_add_task(td->wp, do_unionfind_task2, &tasks[ntasks]);
-            ntasks++;
+    /* XXX lousy hash function */
+    uint32_t clustermap_bucket = u64hash_2(clusterid) % cm->nclustermap;
+    struct uint64_zarray_entry *entry = cm->clustermap[clustermap_bucket];
+    while (entry && entry->id != clusterid) {
+        entry = entry->next;
+    }
+
+    if (!entry) {
+        if (cm->mem_pool_loc == cm->mem_chunk_size) {
+            cm->mem_pool_loc = 0;
+            cm->mem_pool_idx++;
+            cm->mem_pools[cm->mem_pool_idx] = calloc(cm->mem_chunk_size, sizeof(struct uint64_zarray_entry));
         }
+        entry = cm->mem_pools[cm->mem_pool_idx] + cm->mem_pool_loc;
+        cm->mem_pool_loc++;
+
+        entry->id = clusterid;
+        entry->cluster = zarray_create(sizeof(struct pt));
+        entry->last_pixel = 0xffffffff;
+        entry->next = cm->clustermap[clustermap_bucket];
+        cm->clustermap[clustermap_bucket] = entry;
+    }
 
-        workerpool_run(td->wp);
+    if (cm->merge_points && entry->last_pixel == pixel) {
+        struct pt *last;
+        zarray_get_volatile(entry->cluster, zarray_size(entry->cluster) - 1, &last);
+        last->gx += p.gx;
+        last->gy += p.gy;
+        return true;
+    }
+
+    entry->last_pixel = pixel;
+    zarray_add(entry->cluster, &p);
+    return true;
+}
+
+// Moves the clusters to the clusters array, ordered by hash bucket and
+// then id, and frees the map. (Unless the points were appended to
+// cm->pts instead.)
+static void cluster_map_finish(struct cluster_map *cm, zarray_t *clusters)
+{
+    if (cm->pts)
+        return;
 
-        // XXX stitch together the different chunks.
-        for (int i = 1; i < ntasks; i++) {
-            do_unionfind_line2(uf, threshim, w, ts, tasks[i].y0 - 1);
+    int nclustermap = cm->nclustermap;
+
+    for (int i = 0; i < nclustermap; i++) {
+        int start = zarray_size(clusters);
+        for (struct uint64_zarray_entry *entry = cm->clustermap[i]; entry; entry = entry->next) {
+            struct cluster_hash* cluster_hash = malloc(sizeof(struct cluster_hash));
+            cluster_hash->hash = u64hash_2(entry->id) % nclustermap;
+            cluster_hash->id = entry->id;
+            cluster_hash->data = entry->cluster;
+            zarray_add(clusters, &cluster_hash);
         }
+        int end = zarray_size(clusters);
 
-        free(tasks);
+        // Do a quick bubblesort on the secondary key.
+        int n = end - start;
+        for (int j = 0; j < n - 1; j++) {
+            for (int k = 0; k < n - j - 1; k++) {
+                struct cluster_hash** hash1;
+                struct cluster_hash** hash2;
+                zarray_get_volatile(clusters, start + k, &hash1);
+                zarray_get_volatile(clusters, start + k + 1, &hash2);
+                if ((*hash1)->id > (*hash2)->id) {
+                    struct cluster_hash tmp = **hash2;
+                    **hash2 = **hash1;
+                    **hash1 = tmp;
+                }
+            }
+        }
     }
-    return uf;
+    for (int i = 0; i <= cm->mem_pool_idx; i++) {
+        free(cm->mem_pools[i]);
+    }
+    free(cm->mem_pools);
+    free(cm->clustermap);
 }
 
-zarray_t* do_gradient_clusters(image_u8_t* threshim, int ts, int y0, int y1, int w, int nclustermap, unionfind_t* uf, zarray_t* clusters) {
-    struct uint64_zarray_entry **clustermap = calloc(nclustermap, sizeof(struct uint64_zarray_entry*));
-
-    int mem_chunk_size = 2048;
-    struct uint64_zarray_entry** mem_pools = malloc(sizeof(struct uint64_zarray_entry *)*(1 + 2 * nclustermap / mem_chunk_size)); // SmodeTech: avoid memory corruption when nclustermap < mem_chunk_size
-    int mem_pool_idx = 0;
-    int mem_pool_loc = 0;
-    mem_pools[mem_pool_idx] = calloc(mem_chunk_size, sizeof(struct uint64_zarray_entry));
+zarray_t* do_gradient_clusters(image_u8_t* threshim, int ts, int y0, int y1, int w, int nclustermap, struct ccl_lookup *cl,
+                               zarray_t* clusters, struct cluster_pts *pts, bool merge_points) {
+    struct cluster_map cm;
+    cluster_map_init(&cm, nclustermap, pts, merge_points);
 
     for (int y = y0; y < y1; y++) {
+        ccl_lookup_row(cl, y);
         bool connected_last = false;
         for (int x = 1; x < w-1; x++) {
 
@@ -1562,73 +3098,29 @@ zarray_t* do_gradient_clusters(image_u8_t* threshim, int ts, int y0, int y1, int
             }
 
             // XXX don't query this until we know we need it?
-            uint64_t rep0 = unionfind_get_representative(uf, y*w + x);
-            if (unionfind_get_set_size(uf, rep0) < 25) {
+            uint64_t rep0 = ccl_lookup_rep(cl, x, y);
+            if (ccl_lookup_size(cl, rep0) < 25) {
                 connected_last = false;
                 continue;
             }
 
-            // whenever we find two adjacent pixels such that one is
-            // white and the other black, we add the point half-way
-            // between them to a cluster associated with the unique
-            // ids of the white and black regions.
-            //
-            // We additionally compute the gradient direction (i.e., which
-            // direction was the white pixel?) Note: if (v1-v0) == 255, then
-            // (dx,dy) points towards the white pixel. if (v1-v0) == -255, then
-            // (dx,dy) points towards the black pixel. p.gx and p.gy will thus
-            // be -255, 0, or 255.
-            //
             // Note that any given pixel might be added to multiple
             // different clusters. But in the common case, a given
             // pixel will be added multiple times to the same cluster,
             // which increases the size of the cluster and thus the
             // computational costs.
             //
-            // A possible optimization would be to combine entries
-            // within the same cluster.
+            // qtp.merge_cluster_points combines the entries within
+            // the same cluster (see cluster_map_connect()).
 
             bool connected;
 #define DO_CONN(dx, dy)                                                 \
             if (1) {                                                    \
                 uint8_t v1 = threshim->buf[(y + dy)*ts + x + dx];       \
                                                                         \
-                if (v0 + v1 == 255) {                                   \
-                    uint64_t rep1 = unionfind_get_representative(uf, (y + dy)*w + x + dx); \
-                    if (unionfind_get_set_size(uf, rep1) > 24) {        \
-                        uint64_t clusterid;                                 \
-                        if (rep0 < rep1)                                    \
-                            clusterid = (rep1 << 32) + rep0;                \
-                        else                                                \
-                            clusterid = (rep0 << 32) + rep1;                \
-                                                                            \
-                        /* XXX lousy hash function */                       \
-                        uint32_t clustermap_bucket = u64hash_2(clusterid) % nclustermap; \
-                        struct uint64_zarray_entry *entry = clustermap[clustermap_bucket]; \
-                        while (entry && entry->id != clusterid) {           \
-                            entry = entry->next;                            \
-                        }                                                   \
-                                                                            \
-                        if (!entry) {                                       \
-                            if (mem_pool_loc == mem_chunk_size) {           \
-                                mem_pool_loc = 0;                           \
-                                mem_pool_idx++;                             \
-                                mem_pools[mem_pool_idx] = calloc(mem_chunk_size, sizeof(struct uint64_zarray_entry)); \
-                            }                                               \
-                            entry = mem_pools[mem_pool_idx] + mem_pool_loc; \
-                            mem_pool_loc++;                                 \
-                                                                            \
-                            entry->id = clusterid;                          \
-                            entry->cluster = zarray_create(sizeof(struct pt)); \
-                            entry->next = clustermap[clustermap_bucket];    \
-                            clustermap[clustermap_bucket] = entry;          \
-                        }                                                   \
-                                                                            \
-                        struct pt p = { .x = 2*x + dx, .y = 2*y + dy, .gx = dx*((int) v1-v0), .gy = dy*((int) v1-v0)}; \
-                        zarray_add(entry->cluster, &p);                     \
-                        connected = true;                                   \
-                    }                                                   \
-                }                                                       \
+                if (v0 + v1 == 255 &&                                   \
+                    cluster_map_connect(&cm, cl, x, y, dx, dy, rep0, v0, v1)) \
+                    connected = true;                                   \
             }
 
             // do 4 connectivity. NB: Arguments must be [-1, 1] or we'll overflow .gx, .gy
@@ -1650,38 +3142,77 @@ zarray_t* do_gradient_clusters(image_u8_t* threshim, int ts, int y0, int y1, int
     }
 #undef DO_CONN
 
-    for (int i = 0; i < nclustermap; i++) {
-        int start = zarray_size(clusters);
-        for (struct uint64_zarray_entry *entry = clustermap[i]; entry; entry = entry->next) {
-            struct cluster_hash* cluster_hash = malloc(sizeof(struct cluster_hash));
-            cluster_hash->hash = u64hash_2(entry->id) % nclustermap;
-            cluster_hash->id = entry->id;
-            cluster_hash->data = entry->cluster;
-            zarray_add(clusters, &cluster_hash);
-        }
-        int end = zarray_size(clusters);
+    cluster_map_finish(&cm, clusters);
 
-        // Do a quick bubblesort on the secondary key.
-        int n = end - start;
-        for (int j = 0; j < n - 1; j++) {
-            for (int k = 0; k < n - j - 1; k++) {
-                struct cluster_hash** hash1;
-                struct cluster_hash** hash2;
-                zarray_get_volatile(clusters, start + k, &hash1);
-                zarray_get_volatile(clusters, start + k + 1, &hash2);
-                if ((*hash1)->id > (*hash2)->id) {
-                    struct cluster_hash tmp = **hash2;
-                    **hash2 = **hash1;
-                    **hash1 = tmp;
+    return clusters;
+}
+
+// do_gradient_clusters() on the packed image. The boundaries in each of
+// the four directions are found 64 pixels at a time, and only pixels
+// on some boundary are visited. Skipping a pixel is equivalent to
+// visiting it and failing every DO_CONN, so the clusters (including
+// the order of their points) are identical.
+zarray_t* do_gradient_clusters_bits(thresh_bits_t *bits, int y0, int y1, int nclustermap, struct ccl_lookup *cl,
+                                    zarray_t* clusters, struct cluster_pts *pts, bool merge_points) {
+    int w = bits->width, ws = bits->wstride;
+
+    struct cluster_map cm;
+    cluster_map_init(&cm, nclustermap, pts, merge_points);
+
+    for (int y = y0; y < y1; y++) {
+        const uint64_t *V = &bits->valid[y*ws], *U = &bits->value[y*ws];
+        const uint64_t *Vd = V + ws, *Ud = U + ws;
+
+        ccl_lookup_row(cl, y);
+        bool connected_last = false;
+        int last_x = 0;
+
+        for (int k = 0; k < ws; k++) {
+            uint64_t v = V[k] & bits_span(k, 1, w - 1);
+            if (v == 0)
+                continue;
+            uint64_t u = U[k];
+
+            // a boundary is a pair of valid pixels with different values.
+            uint64_t e_1_0 = v & bits_right(V, k, ws) & (u ^ bits_right(U, k, ws));
+            uint64_t e_0_1 = v & Vd[k] & (u ^ Ud[k]);
+            uint64_t e_m1_1 = v & bits_left(Vd, k) & (u ^ bits_left(Ud, k));
+            uint64_t e_1_1 = v & bits_right(Vd, k, ws) & (u ^ bits_right(Ud, k, ws));
+
+            uint64_t todo = e_1_0 | e_0_1 | e_m1_1 | e_1_1;
+            while (todo) {
+                int b = ctz64(todo);
+                uint64_t bit = ((uint64_t) 1) << b;
+                int x = 64*k + b;
+                todo &= todo - 1;
+
+                if (x != last_x + 1)
+                    connected_last = false;
+                last_x = x;
+
+                uint64_t rep0 = ccl_lookup_rep(cl, x, y);
+                if (ccl_lookup_size(cl, rep0) < 25) {
+                    connected_last = false;
+                    continue;
                 }
+
+                int v0 = (u & bit) ? 255 : 0;
+                int v1 = 255 - v0;
+
+                if (e_1_0 & bit)
+                    cluster_map_connect(&cm, cl, x, y, 1, 0, rep0, v0, v1);
+                if (e_0_1 & bit)
+                    cluster_map_connect(&cm, cl, x, y, 0, 1, rep0, v0, v1);
+                if (!connected_last && (e_m1_1 & bit))
+                    cluster_map_connect(&cm, cl, x, y, -1, 1, rep0, v0, v1);
+
+                connected_last = (e_1_1 & bit) &&
+                    cluster_map_connect(&cm, cl, x, y, 1, 1, rep0, v0, v1);
             }
         }
     }
-    for (int i = 0; i <= mem_pool_idx; i++) {
-        free(mem_pools[i]);
-    }
-    free(mem_pools);
-    free(clustermap);
+
+    cluster_map_finish(&cm, clusters);
 
     return clusters;
 }
@@ -1690,7 +3221,16 @@ static void do_cluster_task(void *p)
 {
     struct cluster_task *task = (struct cluster_task*) p;
 
-    do_gradient_clusters(task->im, task->s, task->y0, task->y1, task->w, task->nclustermap, task->uf, task->clusters);
+    struct ccl_lookup cl;
+    ccl_lookup_init(&cl, task->uf, task->runs, task->w, task->h);
+    struct cluster_pts *pts = task->sorted ? &task->pts : NULL;
+
+    if (task->bits)
+        do_gradient_clusters_bits(task->bits, task->y0, task->y1, task->nclustermap, &cl, task->clusters, pts, task->merge_points);
+    else
+        do_gradient_clusters(task->im, task->s, task->y0, task->y1, task->w, task->nclustermap, &cl, task->clusters, pts, task->merge_points);
+
+    ccl_lookup_destroy(&cl);
 }
 
 zarray_t* merge_clusters(zarray_t* c1, zarray_t* c2) {
@@ -1733,13 +3273,18 @@ zarray_t* merge_clusters(zarray_t* c1, zarray_t* c2) {
     return ret;
 }
 
-zarray_t* gradient_clusters(apriltag_detector_t *td, image_u8_t* threshim, int w, int h, int ts, unionfind_t* uf) {
-    zarray_t* clusters;
+// Runs the gradient clustering of the rows [1, h-2) as tasks of a few
+// rows each, and returns the tasks (in order) and their number. If
+// bits is non-NULL, it is used instead of threshim, and if runs is
+// non-NULL, it is used instead of uf.
+static struct cluster_task* gradient_cluster_tasks(apriltag_detector_t *td, image_u8_t* threshim, thresh_bits_t *bits,
+                                                   int w, int h, int ts, unionfind_t* uf, ccl_runs_t *runs,
+                                                   bool sorted, int *ntasks_out) {
     int nclustermap = 0.2*w*h;
 
     int sz = h - 1;
     int chunksize = 1 + sz / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
-    struct cluster_task *tasks = malloc(sizeof(struct cluster_task)*(sz / chunksize + 1));
+    struct cluster_task *tasks = arena_alloc(td->frame_arena, sizeof(struct cluster_task)*(sz / chunksize + 1));
 
     int ntasks = 0;
 
@@ -1749,11 +3294,17 @@ zarray_t* gradient_clusters(apriltag_detector_t *td, image_u8_t* threshim, int w
         tasks[ntasks].y0 = i;
         tasks[ntasks].y1 = imin(sz, i + chunksize);
         tasks[ntasks].w = w;
+        tasks[ntasks].h = h;
         tasks[ntasks].s = ts;
         tasks[ntasks].uf = uf;
+        tasks[ntasks].runs = runs;
         tasks[ntasks].im = threshim;
+        tasks[ntasks].bits = bits;
         tasks[ntasks].nclustermap = nclustermap/(sz / chunksize + 1);
-        tasks[ntasks].clusters = zarray_create(sizeof(struct cluster_hash*));
+        tasks[ntasks].clusters = sorted ? NULL : zarray_create(sizeof(struct cluster_hash*));
+        tasks[ntasks].merge_points = td->qtp.merge_cluster_points;
+        tasks[ntasks].sorted = sorted;
+        memset(&tasks[ntasks].pts, 0, sizeof(struct cluster_pts));
 
         workerpool_add_task(td->wp, do_cluster_task, &tasks[ntasks]);
         ntasks++;
@@ -1761,7 +3312,18 @@ zarray_t* gradient_clusters(apriltag_detector_t *td, image_u8_t* threshim, int w
 
     workerpool_run(td->wp);
 
-    zarray_t** clusters_list = malloc(sizeof(zarray_t *)*ntasks);
+    *ntasks_out = ntasks;
+    return tasks;
+}
+
+static zarray_t* gradient_clusters_impl(apriltag_detector_t *td, image_u8_t* threshim, thresh_bits_t *bits,
+                                        int w, int h, int ts, unionfind_t* uf, ccl_runs_t *runs) {
+    zarray_t* clusters;
+
+    int ntasks;
+    struct cluster_task *tasks = gradient_cluster_tasks(td, threshim, bits, w, h, ts, uf, runs, false, &ntasks);
+
+    zarray_t** clusters_list = arena_alloc(td->frame_arena, sizeof(zarray_t *)*ntasks);
     for (int i = 0; i < ntasks; i++) {
         clusters_list[i] = tasks[i].clusters;
     }
@@ -1790,11 +3352,122 @@ zarray_t* gradient_clusters(apriltag_detector_t *td, image_u8_t* threshim, int w
         free(*hash);
     }
     zarray_destroy(clusters_list[0]);
-    free(clusters_list);
-    free(tasks);
     return clusters;
 }
 
+zarray_t* gradient_clusters(apriltag_detector_t *td, image_u8_t* threshim, int w, int h, int ts, unionfind_t* uf) {
+    return gradient_clusters_impl(td, threshim, NULL, w, h, ts, uf, NULL);
+}
+
+// One cluster found by one task.
+struct cluster_piece
+{
+    uint64_t id;
+    int task;
+    uint32_t cidx;
+};
+
+// orders pieces by cluster id, and then by task.
+static int cluster_piece_compare(const void *_a, const void *_b)
+{
+    const struct cluster_piece *a = _a;
+    const struct cluster_piece *b = _b;
+
+    if (a->id != b->id)
+        return a->id < b->id ? -1 : 1;
+    return a->task - b->task;
+}
+
+// the second half of a counting sort: task->pts.counts[cidx] must be
+// where the first point of the cluster goes in task->dst.
+static void do_cluster_scatter_task(void *p)
+{
+    struct cluster_task *task = (struct cluster_task*) p;
+    struct cluster_pts *cp = &task->pts;
+
+    for (int i = 0; i < cp->size; i++) {
+        struct cluster_pt *cpt = &cp->data[i];
+        struct pt *p = &task->dst[cp->counts[cpt->cidx]++];
+        p->x = cpt->x;
+        p->y = cpt->y;
+        p->gx = cpt->gx;
+        p->gy = cpt->gy;
+        p->slope = 0;
+    }
+}
+
+// Like gradient_clusters_impl(), but without any per-cluster
+// allocations: each task appends its points to one flat array (see
+// struct cluster_pts), and a counting sort then moves every point
+// straight to its place in one array, where each cluster is a
+// contiguous span. The points of each cluster are in the same order as
+// with the hash map (the clusters themselves are ordered differently).
+//
+// Returns an array of struct cluster_span, pointing into *pts, which
+// is allocated from td->frame_arena.
+static zarray_t* gradient_clusters_sorted(apriltag_detector_t *td, image_u8_t* threshim, thresh_bits_t *bits,
+                                          int w, int h, int ts, unionfind_t* uf, ccl_runs_t *runs,
+                                          struct pt **pts) {
+    int ntasks;
+    struct cluster_task *tasks = gradient_cluster_tasks(td, threshim, bits, w, h, ts, uf, runs, true, &ntasks);
+
+    int npieces = 0, npts = 0;
+    for (int i = 0; i < ntasks; i++) {
+        npieces += tasks[i].pts.nclusters;
+        npts += tasks[i].pts.size;
+    }
+
+    struct cluster_piece *pieces = arena_alloc(td->frame_arena, sizeof(struct cluster_piece)*npieces);
+    npieces = 0;
+    for (int i = 0; i < ntasks; i++) {
+        for (int j = 0; j < tasks[i].pts.nclusters; j++) {
+            pieces[npieces].id = tasks[i].pts.ids[j];
+            pieces[npieces].task = i;
+            pieces[npieces].cidx = j;
+            npieces++;
+        }
+    }
+
+    // there are far fewer clusters than points.
+    qsort(pieces, npieces, sizeof(struct cluster_piece), cluster_piece_compare);
+
+    *pts = arena_alloc(td->frame_arena, sizeof(struct pt)*npts);
+
+    // lay out the clusters, each one's pieces in task order, replacing
+    // the counts with the positions of the pieces.
+    zarray_t *clusters = zarray_create(sizeof(struct cluster_span));
+    struct cluster_span cluster = { .pts = *pts, .sz = 0 };
+    uint32_t pos = 0;
+
+    for (int i = 0; i < npieces; i++) {
+        if (i > 0 && pieces[i].id != pieces[i-1].id) {
+            zarray_add(clusters, &cluster);
+            cluster.pts = *pts + pos;
+            cluster.sz = 0;
+        }
+
+        uint32_t *count = &tasks[pieces[i].task].pts.counts[pieces[i].cidx];
+        cluster.sz += *count;
+        uint32_t next = pos + *count;
+        *count = pos;
+        pos = next;
+    }
+    if (npieces > 0)
+        zarray_add(clusters, &cluster);
+
+    for (int i = 0; i < ntasks; i++) {
+        tasks[i].dst = *pts;
+        workerpool_add_task(td->wp, do_cluster_scatter_task, &tasks[i]);
+    }
+    workerpool_run(td->wp);
+
+    for (int i = 0; i < ntasks; i++)
+        cluster_pts_free(&tasks[i].pts);
+
+    return clusters;
+}
+
+// clusters is an array of struct cluster_span.
 zarray_t* fit_quads(apriltag_detector_t *td, int w, int h, zarray_t* clusters, image_u8_t* im) {
     zarray_t *quads = zarray_create(sizeof(struct quad));
 
@@ -1817,8 +3490,26 @@ zarray_t* fit_quads(apriltag_detector_t *td, int w, int h, zarray_t* clusters, i
     }
 
     int sz = zarray_size(clusters);
+
+    // the clusters that do_quad_task() will fit.
+    td->nclusters = 0;
+    td->ncluster_points = 0;
+    for (int i = 0; i < sz; i++) {
+        struct cluster_span *cluster;
+        zarray_get_volatile(clusters, i, &cluster);
+        if (quad_cluster_fits(td, cluster, w, h)) {
+            td->nclusters++;
+            td->ncluster_points += cluster->sz;
+        }
+    }
+
     int chunksize = 1 + sz / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
-    struct quad_task *tasks = malloc(sizeof(struct quad_task)*(sz / chunksize + 1));
+    struct quad_task *tasks = arena_alloc(td->frame_arena, sizeof(struct quad_task)*(sz / chunksize + 1));
+
+    // each task writes its quads to its own part of quad_buf, without
+    // locking, and they are concatenated in task (so cluster) order.
+    struct quad *quad_buf = arena_alloc(td->frame_arena, sizeof(struct quad)*td->nclusters);
+    int nquad_buf = 0;
 
     int ntasks = 0;
     for (int i = 0; i < sz; i += chunksize) {
@@ -1827,7 +3518,13 @@ zarray_t* fit_quads(apriltag_detector_t *td, int w, int h, zarray_t* clusters, i
         tasks[ntasks].cidx1 = imin(sz, i + chunksize);
         tasks[ntasks].h = h;
         tasks[ntasks].w = w;
-        tasks[ntasks].quads = quads;
+        tasks[ntasks].quads = &quad_buf[nquad_buf];
+        tasks[ntasks].nquads = 0;
+        for (int j = tasks[ntasks].cidx0; j < tasks[ntasks].cidx1; j++) {
+            struct cluster_span *cluster;
+            zarray_get_volatile(clusters, j, &cluster);
+            nquad_buf += quad_cluster_fits(td, cluster, w, h);
+        }
         tasks[ntasks].clusters = clusters;
         tasks[ntasks].im = im;
         tasks[ntasks].tag_width = min_tag_width;
@@ -1840,11 +3537,40 @@ zarray_t* fit_quads(apriltag_detector_t *td, int w, int h, zarray_t* clusters, i
 
     workerpool_run(td->wp);
 
-    free(tasks);
+    int nquads = 0;
+    for (int i = 0; i < ntasks; i++)
+        nquads += tasks[i].nquads;
+    zarray_ensure_capacity(quads, nquads);
+    for (int i = 0; i < ntasks; i++) {
+        for (int j = 0; j < tasks[i].nquads; j++)
+            zarray_add(quads, &tasks[i].quads[j]);
+    }
 
     return quads;
 }
 
+// color the pixel by its component v, picking a new random color for
+// new components.
+static void debug_segmentation_pixel(image_u8x3_t *d, uint32_t *colors, uint32_t v, int x, int y)
+{
+    uint32_t color = colors[v];
+    uint8_t r = color >> 16,
+        g = color >> 8,
+        b = color;
+
+    if (color == 0) {
+        const int bias = 50;
+        r = bias + (random() % (200-bias));
+        g = bias + (random() % (200-bias));
+        b = bias + (random() % (200-bias));
+        colors[v] = (r << 16) | (g << 8) | b;
+    }
+
+    d->buf[y*d->stride + 3*x + 0] = r;
+    d->buf[y*d->stride + 3*x + 1] = g;
+    d->buf[y*d->stride + 3*x + 2] = b;
+}
+
 zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
 {
     ////////////////////////////////////////////////////////
@@ -1852,16 +3578,35 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
 
     int w = im->width, h = im->height;
 
-    image_u8_t *threshim = threshold(td, im);
-    int ts = threshim->stride;
+    image_u8_t *threshim = NULL;
+    thresh_bits_t *bits = NULL;
+    int ts = 0;
+
+    if (td->qtp.packed_threshold) {
+        bits = threshold_bits(td, im);
+
+        if (td->debug) {
+            image_u8_t *d = thresh_bits_to_image(bits);
+            image_u8_write_pnm(d, "debug_threshold.pnm");
+            image_u8_destroy(d);
+        }
+    } else {
+        threshim = threshold(td, im);
+        ts = threshim->stride;
 
-    if (td->debug)
-        image_u8_write_pnm(threshim, "debug_threshold.pnm");
+        if (td->debug)
+            image_u8_write_pnm(threshim, "debug_threshold.pnm");
+    }
 
 
     ////////////////////////////////////////////////////////
     // step 2. find connected components.
-    unionfind_t* uf = connected_components(td, threshim, w, h, ts);
+    unionfind_t* uf = NULL;
+    ccl_runs_t *runs = NULL;
+    if (td->qtp.run_length_components)
+        runs = connected_components_runs(td, threshim, bits, w, h);
+    else
+        uf = connected_components_impl(td, threshim, bits, w, h, ts);
 
     // make segmentation image.
     if (td->debug) {
@@ -1870,28 +3615,26 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
         uint32_t *colors = (uint32_t*) calloc(w*h, sizeof(*colors));
 
         for (int y = 0; y < h; y++) {
+            if (runs) {
+                for (uint32_t i = runs->row_start[y]; i < runs->row_start[y+1]; i++) {
+                    uint32_t v = unionfind_get_representative(runs->uf, i);
+
+                    if ((int)unionfind_get_set_size(runs->uf, v) < td->qtp.min_cluster_pixels)
+                        continue;
+
+                    for (int x = runs->runs[i].x0; x < runs->runs[i].x1; x++)
+                        debug_segmentation_pixel(d, colors, v, x, y);
+                }
+                continue;
+            }
+
             for (int x = 0; x < w; x++) {
                 uint32_t v = unionfind_get_representative(uf, y*w+x);
 
                 if ((int)unionfind_get_set_size(uf, v) < td->qtp.min_cluster_pixels)
                     continue;
 
-                uint32_t color = colors[v];
-                uint8_t r = color >> 16,
-                    g = color >> 8,
-                    b = color;
-
-                if (color == 0) {
-                    const int bias = 50;
-                    r = bias + (random() % (200-bias));
-                    g = bias + (random() % (200-bias));
-                    b = bias + (random() % (200-bias));
-                    colors[v] = (r << 16) | (g << 8) | b;
-                }
-
-                d->buf[y*d->stride + 3*x + 0] = r;
-                d->buf[y*d->stride + 3*x + 1] = g;
-                d->buf[y*d->stride + 3*x + 2] = b;
+                debug_segmentation_pixel(d, colors, v, x, y);
             }
         }
 
@@ -1904,14 +3647,32 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
 
     timeprofile_stamp(td->tp, "unionfind");
 
-    zarray_t* clusters = gradient_clusters(td, threshim, w, h, ts, uf);
+    // clusters is an array of struct cluster_span, whose points belong
+    // to either cluster_pts or cluster_arrays.
+    struct pt *cluster_pts = NULL;
+    zarray_t *cluster_arrays = NULL;
+    zarray_t *clusters;
+    if (td->qtp.sorted_clusters) {
+        clusters = gradient_clusters_sorted(td, threshim, bits, w, h, ts, uf, runs, &cluster_pts);
+    } else {
+        cluster_arrays = gradient_clusters_impl(td, threshim, bits, w, h, ts, uf, runs);
+
+        clusters = zarray_create(sizeof(struct cluster_span));
+        for (int i = 0; i < zarray_size(cluster_arrays); i++) {
+            zarray_t *cluster;
+            zarray_get(cluster_arrays, i, &cluster);
+
+            struct cluster_span span = { .pts = (struct pt*) cluster->data, .sz = zarray_size(cluster) };
+            zarray_add(clusters, &span);
+        }
+    }
 
     if (td->debug) {
         image_u8x3_t *d = image_u8x3_create(w, h);
 
         for (int i = 0; i < zarray_size(clusters); i++) {
-            zarray_t *cluster;
-            zarray_get(clusters, i, &cluster);
+            struct cluster_span *cluster;
+            zarray_get_volatile(clusters, i, &cluster);
 
             uint32_t r, g, b;
 
@@ -1922,9 +3683,8 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
                 b = bias + (random() % (200-bias));
             }
 
-            for (int j = 0; j < zarray_size(cluster); j++) {
-                struct pt *p;
-                zarray_get_volatile(cluster, j, &p);
+            for (int j = 0; j < cluster->sz; j++) {
+                struct pt *p = &cluster->pts[j];
 
                 int x = p->x / 2;
                 int y = p->y / 2;
@@ -1939,7 +3699,10 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
     }
 
 
-    image_u8_destroy(threshim);
+    if (bits)
+        thresh_bits_destroy(bits);
+    else
+        image_u8_destroy(threshim);
     timeprofile_stamp(td->tp, "make clusters");
 
     ////////////////////////////////////////////////////////
@@ -1989,12 +3752,18 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
 
     timeprofile_stamp(td->tp, "fit quads to clusters");
 
-    unionfind_destroy(uf);
+    if (runs)
+        ccl_runs_destroy(runs);
+    else
+        unionfind_destroy(uf);
 
-    for (int i = 0; i < zarray_size(clusters); i++) {
-        zarray_t *cluster;
-        zarray_get(clusters, i, &cluster);
-        zarray_destroy(cluster);
+    if (cluster_arrays) {
+        for (int i = 0; i < zarray_size(cluster_arrays); i++) {
+            zarray_t *cluster;
+            zarray_get(cluster_arrays, i, &cluster);
+            zarray_destroy(cluster);
+        }
+        zarray_destroy(cluster_arrays);
     }
     zarray_destroy(clusters);
 
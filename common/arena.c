@@ -0,0 +1,119 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+static struct arena_block *arena_block_create(struct arena_block *prev, size_t size)
+{
+    struct arena_block *b = malloc(ARENA_HEADER_SIZE + size);
+    b->prev = prev;
+    b->size = size;
+    b->pos = 0;
+    return b;
+}
+
+// frees the newest blocks until stop is the newest.
+static void arena_free_blocks(arena_t *a, struct arena_block *stop)
+{
+    while (a->block != stop) {
+        struct arena_block *prev = a->block->prev;
+        free(a->block);
+        a->block = prev;
+    }
+}
+
+arena_t *arena_create(size_t size)
+{
+    arena_t *a = calloc(1, sizeof(arena_t));
+    a->block = arena_block_create(NULL, size);
+    return a;
+}
+
+void arena_destroy(arena_t *a)
+{
+    if (a == NULL)
+        return;
+
+    arena_free_blocks(a, NULL);
+    free(a);
+}
+
+void *arena_alloc_block(arena_t *a, size_t sz)
+{
+    // each block is at least as large as the previous one, so a run of
+    // small allocations only needs a few of them.
+    size_t size = a->block->size > sz ? a->block->size : sz;
+    if (size < 4096)
+        size = 4096;
+
+    a->block = arena_block_create(a->block, size);
+
+    return arena_alloc(a, sz);
+}
+
+void *arena_calloc(arena_t *a, size_t n, size_t sz)
+{
+    void *p = arena_alloc(a, n*sz);
+    memset(p, 0, n*sz);
+    return p;
+}
+
+void arena_rewind(arena_t *a, arena_mark_t m)
+{
+    arena_free_blocks(a, m.block);
+
+    assert(m.pos <= a->block->pos);
+    a->block->pos = m.pos;
+    a->used = m.used;
+}
+
+void arena_reset(arena_t *a)
+{
+    while (a->block->prev)
+        arena_free_blocks(a, a->block->prev);
+
+    a->block->pos = 0;
+    a->used = 0;
+
+    if (a->block->size < a->high_water)
+        arena_reserve(a, a->high_water);
+}
+
+void arena_reserve(arena_t *a, size_t size)
+{
+    assert(a->used == 0);
+
+    if (a->block->prev == NULL && a->block->size >= size)
+        return;
+
+    arena_free_blocks(a, NULL);
+    a->block = arena_block_create(NULL, size);
+}
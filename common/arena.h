@@ -0,0 +1,131 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A bump allocator for short-lived buffers. Allocations are carved out
+ * of a block in order and are never freed individually: either all of
+ * them are released at once with arena_reset(), or everything allocated
+ * after a mark is released with arena_rewind().
+ *
+ * When a block fills up, another one is chained on. arena_reset() then
+ * replaces the blocks with a single one large enough for the most that
+ * has ever been allocated at once (the high-water mark), so after a few
+ * rounds of use, an arena no longer calls malloc at all.
+ */
+typedef struct arena arena_t;
+
+struct arena_block
+{
+    struct arena_block *prev;
+    size_t size; // bytes of data following this header
+    size_t pos;  // bytes in use
+};
+
+struct arena
+{
+    struct arena_block *block; // the newest block
+
+    size_t used;       // bytes currently allocated, across all blocks
+    size_t high_water; // the most that has ever been allocated at once
+};
+
+// A position in an arena to rewind to.
+typedef struct arena_mark arena_mark_t;
+struct arena_mark
+{
+    struct arena_block *block;
+    size_t pos;
+    size_t used;
+};
+
+// All allocations are aligned to this many bytes.
+#define ARENA_ALIGN 16
+
+// the block header is padded so that the data after it stays aligned.
+#define ARENA_HEADER_SIZE ((sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
+// Creates an arena with room for size bytes before it has to grow.
+arena_t *arena_create(size_t size);
+void arena_destroy(arena_t *a);
+
+// Slow path of arena_alloc(): chains on a new block.
+void *arena_alloc_block(arena_t *a, size_t sz);
+
+static inline void *arena_alloc(arena_t *a, size_t sz)
+{
+    sz = (sz + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+
+    struct arena_block *b = a->block;
+    if (sz > b->size - b->pos)
+        return arena_alloc_block(a, sz);
+
+    void *p = (char*) b + ARENA_HEADER_SIZE + b->pos;
+    b->pos += sz;
+    a->used += sz;
+    if (a->used > a->high_water)
+        a->high_water = a->used;
+    return p;
+}
+
+// Like arena_alloc(), but the memory is zeroed.
+void *arena_calloc(arena_t *a, size_t n, size_t sz);
+
+static inline arena_mark_t arena_mark(const arena_t *a)
+{
+    arena_mark_t m = { a->block, a->block->pos, a->used };
+    return m;
+}
+
+// Releases everything allocated since m was taken. Blocks chained on
+// since then are freed.
+void arena_rewind(arena_t *a, arena_mark_t m);
+
+// Releases everything. If the arena had to grow since the last reset,
+// its blocks are replaced by one of high_water bytes.
+void arena_reset(arena_t *a);
+
+// Grows the arena (which must be empty) so that size bytes can be
+// allocated without it calling malloc.
+void arena_reserve(arena_t *a, size_t size);
+
+static inline size_t arena_high_water(const arena_t *a)
+{
+    return a->high_water;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,140 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Minimal atomic operations on plain integers. MSVC does not provide
+// <stdatomic.h> in C mode, so these use the compiler intrinsics
+// directly. Loads and stores are relaxed (atomic, but unordered); the
+// read-modify-write operations are full barriers.
+
+static inline uint32_t atomic_load_u32(const uint32_t *p)
+{
+#ifdef _MSC_VER
+    return *(const volatile uint32_t*) p;
+#else
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline void atomic_store_u32(uint32_t *p, uint32_t v)
+{
+#ifdef _MSC_VER
+    *(volatile uint32_t*) p = v;
+#else
+    __atomic_store_n(p, v, __ATOMIC_RELAXED);
+#endif
+}
+
+// Acquire loads and release stores, for publishing data to other
+// threads: everything written before a release store of a value is
+// visible to a thread once its acquire load has returned that value.
+static inline uint32_t atomic_load_acquire_u32(const uint32_t *p)
+{
+#ifdef _MSC_VER
+    return (uint32_t) _InterlockedOr((volatile long*) p, 0);
+#else
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static inline void atomic_store_release_u32(uint32_t *p, uint32_t v)
+{
+#ifdef _MSC_VER
+    _InterlockedExchange((volatile long*) p, (long) v);
+#else
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+#endif
+}
+
+// if *p == expected, set it to desired. Returns true on success.
+static inline bool atomic_cas_u32(uint32_t *p, uint32_t expected, uint32_t desired)
+{
+#ifdef _MSC_VER
+    return (uint32_t) _InterlockedCompareExchange((volatile long*) p, (long) desired, (long) expected) == expected;
+#else
+    return __atomic_compare_exchange_n(p, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// returns the previous value.
+static inline uint32_t atomic_fetch_add_u32(uint32_t *p, uint32_t v)
+{
+#ifdef _MSC_VER
+    return (uint32_t) _InterlockedExchangeAdd((volatile long*) p, (long) v);
+#else
+    return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// 64-bit versions, for values that must change together. (On 32-bit
+// MSVC only a compare-and-swap is available, which serves for all.)
+static inline uint64_t atomic_load_u64(const uint64_t *p)
+{
+#ifdef _MSC_VER
+    return (uint64_t) _InterlockedCompareExchange64((volatile __int64*) p, 0, 0);
+#else
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline bool atomic_cas_u64(uint64_t *p, uint64_t expected, uint64_t desired)
+{
+#ifdef _MSC_VER
+    return (uint64_t) _InterlockedCompareExchange64((volatile __int64*) p, (__int64) desired, (__int64) expected) == expected;
+#else
+    return __atomic_compare_exchange_n(p, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// a full barrier, like the read-modify-write operations.
+static inline void atomic_store_u64(uint64_t *p, uint64_t v)
+{
+#ifdef _MSC_VER
+    uint64_t old;
+    do {
+        old = atomic_load_u64(p);
+    } while (!atomic_cas_u64(p, old, v));
+#else
+    __atomic_store_n(p, v, __ATOMIC_SEQ_CST);
+#endif
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -32,6 +32,11 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include "common/homography.h"
 #include "common/math_util.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HOMOGRAPHY_SSE2
+#include <emmintrin.h>
+#endif
+
 // correspondences is a list of float[4]s, consisting of the points x
 // and y concatenated. We will compute a homography such that y = Hx
 matd_t *homography_compute(zarray_t *correspondences, int flags)
@@ -477,3 +482,37 @@ void quat_to_matrix(const double q[4], matd_t *M)
     MATD_EL(M, 2, 1) = 2*y*z + 2*w*x;
     MATD_EL(M, 2, 2) = w*w - x*x - y*y + z*z;
 }
+
+void homography_project_n(const double *H, const double *x, const double *y, int n, double *ox, double *oy)
+{
+    int i = 0;
+
+#ifdef HOMOGRAPHY_SSE2
+    // two points at a time, with the same operations in the same order
+    // as homography_project().
+    __m128d h00 = _mm_set1_pd(H[0]), h01 = _mm_set1_pd(H[1]), h02 = _mm_set1_pd(H[2]);
+    __m128d h10 = _mm_set1_pd(H[3]), h11 = _mm_set1_pd(H[4]), h12 = _mm_set1_pd(H[5]);
+    __m128d h20 = _mm_set1_pd(H[6]), h21 = _mm_set1_pd(H[7]), h22 = _mm_set1_pd(H[8]);
+
+    for (; i + 2 <= n; i += 2) {
+        __m128d vx = _mm_loadu_pd(&x[i]);
+        __m128d vy = _mm_loadu_pd(&y[i]);
+
+        __m128d xx = _mm_add_pd(_mm_add_pd(_mm_mul_pd(h00, vx), _mm_mul_pd(h01, vy)), h02);
+        __m128d yy = _mm_add_pd(_mm_add_pd(_mm_mul_pd(h10, vx), _mm_mul_pd(h11, vy)), h12);
+        __m128d zz = _mm_add_pd(_mm_add_pd(_mm_mul_pd(h20, vx), _mm_mul_pd(h21, vy)), h22);
+
+        _mm_storeu_pd(&ox[i], _mm_div_pd(xx, zz));
+        _mm_storeu_pd(&oy[i], _mm_div_pd(yy, zz));
+    }
+#endif
+
+    for (; i < n; i++) {
+        double xx = H[0]*x[i] + H[1]*y[i] + H[2];
+        double yy = H[3]*x[i] + H[4]*y[i] + H[5];
+        double zz = H[6]*x[i] + H[7]*y[i] + H[8];
+
+        ox[i] = xx / zz;
+        oy[i] = yy / zz;
+    }
+}
@@ -141,6 +141,12 @@ static inline void homography_project(const matd_t *H, double x, double y, doubl
     *oy = yy / zz;
 }
 
+// Projects the n points (x[i], y[i]) through the 3x3 homography whose
+// row-major elements are H, writing the results to (ox[i], oy[i]).
+// Gives exactly the same results as homography_project() on each point
+// (several at a time, where the CPU has the vector instructions).
+void homography_project_n(const double *H, const double *x, const double *y, int n, double *ox, double *oy);
+
 // assuming that the projection matrix is:
 // [ fx 0  cx 0 ]
 // [  0 fy cy 0 ]
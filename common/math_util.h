@@ -33,6 +33,10 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include <stdint.h>
 #include <assert.h>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -168,6 +172,26 @@ static inline int iclamp(int v, int minv, int maxv)
     return imax(minv, imin(v, maxv));
 }
 
+// index of the lowest set bit. v must be non-zero.
+static inline int ctz64(uint64_t v)
+{
+    assert(v != 0);
+#if defined(_MSC_VER)
+    unsigned long idx;
+#if defined(_M_X64) || defined(_M_ARM64)
+    _BitScanForward64(&idx, v);
+#else
+    if (!_BitScanForward(&idx, (uint32_t) v)) {
+        _BitScanForward(&idx, (uint32_t) (v >> 32));
+        idx += 32;
+    }
+#endif
+    return (int) idx;
+#else
+    return __builtin_ctzll(v);
+#endif
+}
+
 static inline double dclamp(double a, double min, double max)
 {
     if (a < min)
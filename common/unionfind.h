@@ -31,6 +31,8 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "atomic_util.h"
+
 typedef struct unionfind unionfind_t;
 
 struct unionfind
@@ -110,6 +112,13 @@ static inline uint32_t unionfind_get_set_size(unionfind_t *uf, uint32_t id)
     return uf->size[repid] + 1;
 }
 
+// Make id count as weight elements in the set sizes (normally 1). Must
+// be called before id is connected to anything.
+static inline void unionfind_set_weight(unionfind_t *uf, uint32_t id, uint32_t weight)
+{
+    uf->size[id] = weight - 1;
+}
+
 static inline uint32_t unionfind_connect(unionfind_t *uf, uint32_t aid, uint32_t bid)
 {
     uint32_t aroot = unionfind_get_representative(uf, aid);
@@ -143,3 +152,85 @@ static inline uint32_t unionfind_connect(unionfind_t *uf, uint32_t aid, uint32_t
         return broot;
     }
 }
+
+// Concurrent versions of the above, which any number of threads may
+// call at once on the same unionfind_t. (Don't mix them with the
+// sequential versions until all threads are done.)
+//
+// Trees are linked by index: the root with the larger id is attached
+// under the smaller one with a compare-and-swap, so the representative
+// of a set is always its smallest id regardless of the order in which
+// the unions happen. Finds compress paths by halving, which only ever
+// moves a node's parent closer to the root and so needs no retries.
+//
+// Set sizes are not maintained during the unions. Once they are all
+// done, call unionfind_count_sizes_concurrent() over every id (the
+// range can be split across threads) before using any other function.
+static inline uint32_t unionfind_get_representative_concurrent(unionfind_t *uf, uint32_t id)
+{
+    while (1) {
+        uint32_t parent = atomic_load_u32(&uf->parent[id]);
+        if (parent == 0xffffffff || parent == id)
+            return id;
+
+        uint32_t grandparent = atomic_load_u32(&uf->parent[parent]);
+        if (grandparent == 0xffffffff || grandparent == parent)
+            return parent;
+
+        atomic_store_u32(&uf->parent[id], grandparent);
+        id = grandparent;
+    }
+}
+
+static inline void unionfind_connect_concurrent(unionfind_t *uf, uint32_t aid, uint32_t bid)
+{
+    while (1) {
+        uint32_t aroot = unionfind_get_representative_concurrent(uf, aid);
+        uint32_t broot = unionfind_get_representative_concurrent(uf, bid);
+
+        if (aroot == broot)
+            return;
+
+        uint32_t lo = aroot < broot ? aroot : broot;
+        uint32_t hi = aroot < broot ? broot : aroot;
+
+        // hi may have been attached elsewhere since we found it; if
+        // so, start over from the new roots.
+        if (atomic_cas_u32(&uf->parent[hi], 0xffffffff, lo))
+            return;
+
+        aid = aroot;
+        bid = broot;
+    }
+}
+
+// Add the elements [id0, id1) to the sizes of their sets, and mark the
+// roots as their own parents, as the sequential functions expect.
+// Consecutive ids usually share a root, so the additions are batched
+// per root.
+static inline void unionfind_count_sizes_concurrent(unionfind_t *uf, uint32_t id0, uint32_t id1)
+{
+    uint32_t root = 0xffffffff;
+    uint32_t count = 0;
+
+    for (uint32_t id = id0; id < id1; id++) {
+        uint32_t r = unionfind_get_representative_concurrent(uf, id);
+        if (r == id) {
+            atomic_store_u32(&uf->parent[id], id);
+            continue;
+        }
+
+        if (r != root) {
+            if (count)
+                atomic_fetch_add_u32(&uf->size[root], count);
+            root = r;
+            count = 0;
+        }
+        // uf->size[id] is id's own weight (minus one), since it was
+        // never a root that others were added to.
+        count += uf->size[id] + 1;
+    }
+
+    if (count)
+        atomic_fetch_add_u32(&uf->size[root], count);
+}
@@ -31,6 +31,7 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include "common/pthreads_cross.h"
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #ifdef _WIN32
@@ -40,22 +41,53 @@ either expressed or implied, of the Regents of The University of Michigan.
 #endif
 
 #include "workerpool.h"
+#include "atomic_util.h"
 #include "debug_print.h"
 
+// How many times a waiting thread polls before it sleeps. The limit of
+// each thread doubles when work arrives while it is polling, and halves
+// when it has to sleep, so threads spin through the short gaps between
+// the stages of a detection but don't burn a core between frames.
+#define WORKERPOOL_SPIN_MIN 64
+#define WORKERPOOL_SPIN_MAX 4096
+
+// The tasks of a run are split into one contiguous range per thread.
+// Each thread takes tasks from the front of its own range, and when
+// that is empty, steals from the back of the others'. A range is a
+// single word (first task in the low half, end in the high half) so
+// that both ends are updated with one compare-and-swap.
+struct task_range
+{
+    uint64_t range;
+
+    // keep each range on its own cache line.
+    char padding[56];
+};
+
 struct workerpool {
     int nthreads;
     zarray_t *tasks;
-    int taskspos;
 
+    // the calling thread of workerpool_run() is worker 0, so there are
+    // nthreads-1 threads.
     pthread_t *threads;
-    int *status;
+    struct task_range *ranges;
+
+    // incremented (with a release store) to start each run.
+    uint32_t generation;
+    uint32_t stop;
+
+    // how many tasks of the current run haven't finished.
+    uint32_t remaining;
 
     pthread_mutex_t mutex;
     pthread_cond_t startcond;   // used to signal the availability of work
-    bool start_predicate;       // predicate that prevents spurious wakeups on startcond
     pthread_cond_t endcond;     // used to signal completion of all work
+    int nsleeping;              // how many threads wait on startcond
 
-    int end_count; // how many threads are done?
+    // polling is pointless with a single processor: the thread being
+    // waited for can't run meanwhile.
+    bool spin;
 };
 
 struct task
@@ -64,32 +96,105 @@ struct task
     void *p;
 };
 
-void *worker_thread(void *p)
+struct worker
 {
-    workerpool_t *wp = (workerpool_t*) p;
+    workerpool_t *wp;
+    int index;
+};
 
+static inline void cpu_relax(void)
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    _mm_pause();
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_ia32_pause();
+#elif defined(__GNUC__) && defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// take a task from the front of range (or the back if steal). Returns
+// false if the range is empty.
+static bool task_range_take(struct task_range *r, bool steal, uint32_t *task)
+{
     while (1) {
-        struct task *task;
+        uint64_t v = atomic_load_u64(&r->range);
+        uint32_t lo = (uint32_t) v, hi = (uint32_t) (v >> 32);
+        if (lo >= hi)
+            return false;
+
+        uint64_t taken = steal ? ((uint64_t) (hi - 1) << 32) | lo : ((uint64_t) hi << 32) | (lo + 1);
+        if (atomic_cas_u64(&r->range, v, taken)) {
+            *task = steal ? hi - 1 : lo;
+            return true;
+        }
+    }
+}
 
-        pthread_mutex_lock(&wp->mutex);
-        while (wp->taskspos == zarray_size(wp->tasks) || !wp->start_predicate) {
-            wp->end_count++;
-            pthread_cond_broadcast(&wp->endcond);
-            pthread_cond_wait(&wp->startcond, &wp->mutex);
+// run tasks until every range is empty, starting with our own.
+static void workerpool_work(workerpool_t *wp, int index)
+{
+    for (int i = 0; i < wp->nthreads; i++) {
+        struct task_range *r = &wp->ranges[(index + i) % wp->nthreads];
+        uint32_t t;
+
+        while (task_range_take(r, i > 0, &t)) {
+            struct task *task;
+            zarray_get_volatile(wp->tasks, t, &task);
+            task->f(task->p);
+
+            if (atomic_fetch_add_u32(&wp->remaining, (uint32_t) -1) == 1) {
+                pthread_mutex_lock(&wp->mutex);
+                pthread_cond_broadcast(&wp->endcond);
+                pthread_mutex_unlock(&wp->mutex);
+            }
+        }
+    }
+}
+
+// wait for the generation to change from generation, and return it.
+static uint32_t worker_wait(workerpool_t *wp, uint32_t generation, int *spin)
+{
+    for (int i = 0; wp->spin && i < *spin; i++) {
+        uint32_t g = atomic_load_acquire_u32(&wp->generation);
+        if (g != generation) {
+            *spin = *spin < WORKERPOOL_SPIN_MAX ? 2 * *spin : WORKERPOOL_SPIN_MAX;
+            return g;
         }
+        cpu_relax();
+    }
+    if (wp->spin)
+        *spin = *spin > WORKERPOOL_SPIN_MIN ? *spin / 2 : WORKERPOOL_SPIN_MIN;
+
+    uint32_t g;
+    pthread_mutex_lock(&wp->mutex);
+    wp->nsleeping++;
+    while ((g = atomic_load_acquire_u32(&wp->generation)) == generation)
+        pthread_cond_wait(&wp->startcond, &wp->mutex);
+    wp->nsleeping--;
+    pthread_mutex_unlock(&wp->mutex);
+
+    return g;
+}
 
-        zarray_get_volatile(wp->tasks, wp->taskspos, &task);
-        wp->taskspos++;
-        pthread_mutex_unlock(&wp->mutex);
-        sched_yield();
+void *worker_thread(void *p)
+{
+    struct worker *worker = (struct worker*) p;
+    workerpool_t *wp = worker->wp;
+    uint32_t generation = 0;
+    int spin = WORKERPOOL_SPIN_MIN;
+
+    while (1) {
+        generation = worker_wait(wp, generation, &spin);
 
         // we've been asked to exit.
-        if (task->f == NULL)
-            return NULL;
+        if (atomic_load_acquire_u32(&wp->stop))
+            break;
 
-        task->f(task->p);
+        workerpool_work(wp, worker->index);
     }
 
+    free(worker);
     return NULL;
 }
 
@@ -100,30 +205,28 @@ workerpool_t *workerpool_create(int nthreads)
     workerpool_t *wp = calloc(1, sizeof(workerpool_t));
     wp->nthreads = nthreads;
     wp->tasks = zarray_create(sizeof(struct task));
-    wp->start_predicate = false;
 
     if (nthreads > 1) {
         wp->threads = calloc(wp->nthreads, sizeof(pthread_t));
+        wp->ranges = calloc(wp->nthreads, sizeof(struct task_range));
+        wp->spin = workerpool_get_nprocs() > 1;
 
         pthread_mutex_init(&wp->mutex, NULL);
         pthread_cond_init(&wp->startcond, NULL);
         pthread_cond_init(&wp->endcond, NULL);
 
-        for (int i = 0; i < nthreads; i++) {
-            int res = pthread_create(&wp->threads[i], NULL, worker_thread, wp);
+        for (int i = 1; i < nthreads; i++) {
+            struct worker *worker = malloc(sizeof(struct worker));
+            worker->wp = wp;
+            worker->index = i;
+
+            int res = pthread_create(&wp->threads[i], NULL, worker_thread, worker);
             if (res != 0) {
                 debug_print("Insufficient system resources to create workerpool threads\n");
                 // errno already set to EAGAIN by pthread_create() failure
                 return NULL;
             }
         }
-
-        // Wait for the worker threads to be ready
-        pthread_mutex_lock(&wp->mutex);
-        while (wp->end_count < wp->nthreads) {
-            pthread_cond_wait(&wp->endcond, &wp->mutex);
-        }
-        pthread_mutex_unlock(&wp->mutex);
     }
 
     return wp;
@@ -136,21 +239,20 @@ void workerpool_destroy(workerpool_t *wp)
 
     // force all worker threads to exit.
     if (wp->nthreads > 1) {
-        for (int i = 0; i < wp->nthreads; i++)
-            workerpool_add_task(wp, NULL, NULL);
-
         pthread_mutex_lock(&wp->mutex);
-        wp->start_predicate = true;
+        atomic_store_release_u32(&wp->stop, 1);
+        atomic_store_release_u32(&wp->generation, wp->generation + 1);
         pthread_cond_broadcast(&wp->startcond);
         pthread_mutex_unlock(&wp->mutex);
 
-        for (int i = 0; i < wp->nthreads; i++)
+        for (int i = 1; i < wp->nthreads; i++)
             pthread_join(wp->threads[i], NULL);
 
         pthread_mutex_destroy(&wp->mutex);
         pthread_cond_destroy(&wp->startcond);
         pthread_cond_destroy(&wp->endcond);
         free(wp->threads);
+        free(wp->ranges);
     }
 
     zarray_destroy(wp->tasks);
@@ -168,13 +270,7 @@ void workerpool_add_task(workerpool_t *wp, void (*f)(void *p), void *p)
     t.f = f;
     t.p = p;
 
-    if (wp->nthreads > 1) {
-        pthread_mutex_lock(&wp->mutex);
-        zarray_add(wp->tasks, &t);
-        pthread_mutex_unlock(&wp->mutex);
-    } else {
-        zarray_add(wp->tasks, &t);
-    }
+    zarray_add(wp->tasks, &t);
 }
 
 void workerpool_run_single(workerpool_t *wp)
@@ -191,19 +287,35 @@ void workerpool_run_single(workerpool_t *wp)
 // runs all added tasks, waits for them to complete.
 void workerpool_run(workerpool_t *wp)
 {
-    if (wp->nthreads > 1) {
-        pthread_mutex_lock(&wp->mutex);
-        wp->end_count = 0;
-        wp->start_predicate = true;
-        pthread_cond_broadcast(&wp->startcond);
+    int ntasks = zarray_size(wp->tasks);
 
-        while (wp->end_count < wp->nthreads) {
-//            printf("caught %d\n", wp->end_count);
-            pthread_cond_wait(&wp->endcond, &wp->mutex);
+    if (wp->nthreads > 1 && ntasks > 1) {
+        atomic_store_release_u32(&wp->remaining, ntasks);
+
+        // (ranges are published by their full-barrier stores, so that
+        // a thread that takes a task from one sees the task.)
+        for (int i = 0; i < wp->nthreads; i++) {
+            uint64_t lo = (uint64_t) ntasks * i / wp->nthreads;
+            uint64_t hi = (uint64_t) ntasks * (i + 1) / wp->nthreads;
+            atomic_store_u64(&wp->ranges[i].range, (hi << 32) | lo);
         }
 
-        wp->taskspos = 0;
-        wp->start_predicate = false;
+        atomic_store_release_u32(&wp->generation, wp->generation + 1);
+
+        pthread_mutex_lock(&wp->mutex);
+        if (wp->nsleeping > 0)
+            pthread_cond_broadcast(&wp->startcond);
+        pthread_mutex_unlock(&wp->mutex);
+
+        workerpool_work(wp, 0);
+
+        // wait for the tasks that other threads are still running.
+        for (int i = 0; wp->spin && i < WORKERPOOL_SPIN_MAX && atomic_load_acquire_u32(&wp->remaining) > 0; i++)
+            cpu_relax();
+
+        pthread_mutex_lock(&wp->mutex);
+        while (atomic_load_acquire_u32(&wp->remaining) > 0)
+            pthread_cond_wait(&wp->endcond, &wp->mutex);
         pthread_mutex_unlock(&wp->mutex);
 
         zarray_clear(wp->tasks);
@@ -72,6 +72,7 @@ int main(int argc, char *argv[])
     getopt_add_double(getopt, 'x', "decimate", "2.0", "Decimate input image by this factor");
     getopt_add_double(getopt, 'b', "blur", "0.0", "Apply low-pass blur to input; negative sharpens");
     getopt_add_bool(getopt, '0', "refine-edges", 1, "Spend more time trying to align edges of tags");
+    getopt_add_bool(getopt, 'm', "merge-points", 0, "Merge the points each boundary pixel adds to a cluster");
 
     if (!getopt_parse(getopt, argc, argv, 1) || getopt_get_bool(getopt, "help")) {
         printf("Usage: %s [options] <input files>\n", argv[0]);
@@ -121,6 +122,7 @@ int main(int argc, char *argv[])
     td->nthreads = getopt_get_int(getopt, "threads");
     td->debug = getopt_get_bool(getopt, "debug");
     td->refine_edges = getopt_get_bool(getopt, "refine-edges");
+    td->qtp.merge_cluster_points = getopt_get_bool(getopt, "merge-points");
 
     int quiet = getopt_get_bool(getopt, "quiet");
 
@@ -224,6 +226,10 @@ int main(int argc, char *argv[])
 
             if (!quiet) {
                 timeprofile_display(td->tp);
+                printf("clusters %d, mean size %.1f\n", td->nclusters,
+                       td->nclusters ? (double) td->ncluster_points / td->nclusters : 0.0);
+                printf("scratch high-water: frame %zu, worker %zu bytes\n",
+                       td->frame_scratch_high_water, td->worker_scratch_high_water);
             }
 
             total_quads += td->nquads;
@@ -1,8 +1,10 @@
 #include <stdarg.h>
 #include <apriltag.h>
+#include <apriltag_pipeline.h>
 #include <tag36h11.h>
 #include <common/pjpeg.h>
 #include <math.h>
+#include <string.h>
 
 #include "getline.h"
 
@@ -65,10 +67,168 @@ detection_array_element_compare_function(const void *_a, const void *_b)
     return detection_compare_function(a, b);
 }
 
+// apply a detector option given as "name=value" on the command line.
+bool
+set_option(apriltag_detector_t *td, const char *arg)
+{
+    char name[64];
+    int value;
+    if (sscanf(arg, "%63[^=]=%d", name, &value) != 2) {
+        return false;
+    }
+
+    if (!strcmp(name, "nthreads")) {
+        td->nthreads = value;
+    } else if (!strcmp(name, "packed_threshold")) {
+        td->qtp.packed_threshold = value;
+    } else if (!strcmp(name, "run_length_components")) {
+        td->qtp.run_length_components = value;
+    } else if (!strcmp(name, "sorted_clusters")) {
+        td->qtp.sorted_clusters = value;
+    } else if (!strcmp(name, "merge_cluster_points")) {
+        td->qtp.merge_cluster_points = value;
+    } else if (!strcmp(name, "max_decode_table_bytes")) {
+        td->max_decode_table_bytes = value;
+    } else if (!strcmp(name, "lazy_decode_tables")) {
+        td->lazy_decode_tables = value;
+    } else if (!strcmp(name, "fixed_point_sampling")) {
+        td->fixed_point_sampling = value;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+// check that fixed-point sampling finds the same tags as the double
+// precision path, with corners (edges refined) within tolerance pixels.
+bool
+compare_fixed_point_sampling(apriltag_detector_t *td, image_u8_t *im, double tolerance)
+{
+    const bool fixed_point_sampling = td->fixed_point_sampling;
+    const bool refine_edges = td->refine_edges;
+    td->refine_edges = true;
+
+    td->fixed_point_sampling = false;
+    zarray_t *expected = apriltag_detector_detect(td, im);
+    td->fixed_point_sampling = true;
+    zarray_t *detections = apriltag_detector_detect(td, im);
+
+    td->fixed_point_sampling = fixed_point_sampling;
+    td->refine_edges = refine_edges;
+
+    zarray_sort(expected, detection_array_element_compare_function);
+    zarray_sort(detections, detection_array_element_compare_function);
+
+    bool ok = zarray_size(detections) == zarray_size(expected);
+    if (!ok) {
+        fprintf(stderr, "fixed-point sampling found %d detections, expected %d\n",
+                zarray_size(detections), zarray_size(expected));
+    }
+
+    double max_error = 0;
+    for (int i = 0; ok && i < zarray_size(detections); i++) {
+        apriltag_detection_t *det, *ref;
+        zarray_get(detections, i, &det);
+        zarray_get(expected, i, &ref);
+
+        if (det->id != ref->id || det->hamming != ref->hamming) {
+            fprintf(stderr, "fixed-point sampling decoded %d, expected %d\n", det->id, ref->id);
+            ok = false;
+        }
+        for (int e = 0; e < 4; e++) {
+            for (int c = 0; c < 2; c++) {
+                max_error = fmax(max_error, fabs(det->p[e][c] - ref->p[e][c]));
+            }
+        }
+    }
+
+    printf("Fixed-point sampling: largest corner difference %.5f px\n", max_error);
+    if (max_error > tolerance) {
+        fprintf(stderr, "fixed-point corners differ by %.5f px, tolerance %.5f\n", max_error, tolerance);
+        ok = false;
+    }
+
+    apriltag_detections_destroy(expected);
+    apriltag_detections_destroy(detections);
+    return ok;
+}
+
+struct pipeline_check
+{
+    zarray_t *expected;
+    uint64_t next_frame;
+    bool ok;
+};
+
+void
+pipeline_check_callback(void *user, uint64_t frame, image_u8_t *im, zarray_t *detections)
+{
+    (void) im;
+    struct pipeline_check *check = user;
+
+    if (frame != check->next_frame++) {
+        fprintf(stderr, "pipeline delivered frame %d out of order\n", (int) frame);
+        check->ok = false;
+    }
+
+    zarray_sort(detections, detection_array_element_compare_function);
+
+    if (zarray_size(detections) != zarray_size(check->expected)) {
+        fprintf(stderr, "pipeline found %d detections in frame %d, expected %d\n",
+                zarray_size(detections), (int) frame, zarray_size(check->expected));
+        check->ok = false;
+    }
+    for (int i = 0; i < zarray_size(detections) && i < zarray_size(check->expected); i++) {
+        apriltag_detection_t *det, *ref;
+        zarray_get(detections, i, &det);
+        zarray_get(check->expected, i, &ref);
+
+        if (det->id != ref->id || memcmp(det->p, ref->p, sizeof(det->p))) {
+            fprintf(stderr, "pipeline mismatch at detection %d of frame %d\n", i, (int) frame);
+            check->ok = false;
+        }
+    }
+
+    apriltag_detections_destroy(detections);
+}
+
+// check that a pipeline of the given depth delivers every frame, in
+// order, with the same detections as td finds on its own.
+bool
+compare_pipeline(apriltag_detector_t *td, image_u8_t *im, int depth)
+{
+    struct pipeline_check check;
+    check.expected = apriltag_detector_detect(td, im);
+    zarray_sort(check.expected, detection_array_element_compare_function);
+    check.next_frame = 0;
+    check.ok = true;
+
+    apriltag_pipeline_t *pl = apriltag_pipeline_create(td, depth, pipeline_check_callback, &check);
+    if (pl == NULL) {
+        apriltag_detections_destroy(check.expected);
+        return false;
+    }
+
+    const int nframes = 3*depth + 1;
+    for (int i = 0; i < nframes; i++) {
+        apriltag_pipeline_submit(pl, im);
+    }
+    apriltag_pipeline_destroy(pl);
+
+    if (check.next_frame != (uint64_t) nframes) {
+        fprintf(stderr, "pipeline delivered %d frames, expected %d\n", (int) check.next_frame, nframes);
+        check.ok = false;
+    }
+
+    apriltag_detections_destroy(check.expected);
+    return check.ok;
+}
+
 int
 main(int argc, char *argv[])
 {
-    if (argc!=2) {
+    if (argc<2) {
         return EXIT_FAILURE;
     }
 
@@ -89,16 +249,86 @@ main(int argc, char *argv[])
     apriltag_detector_t *td = apriltag_detector_create();
     td->quad_decimate = 1;
     td->refine_edges = false;
+
+    // "decode_table=<path>" saves the decode table to path and maps it.
+    const char *decode_table = NULL;
+
+    // "fixed_point_tolerance=<thousandths of a pixel>" compares
+    // fixed-point sampling with the double precision path.
+    int fixed_point_tolerance = -1;
+
+    // "pipeline=<depth>" compares a pipeline with the detector.
+    int pipeline_depth = 0;
+
+    for (int a = 2; a < argc; a++) {
+        if (!strncmp(argv[a], "decode_table=", 13)) {
+            decode_table = argv[a] + 13;
+        } else if (sscanf(argv[a], "fixed_point_tolerance=%d", &fixed_point_tolerance) == 1) {
+            continue;
+        } else if (sscanf(argv[a], "pipeline=%d", &pipeline_depth) == 1) {
+            continue;
+        } else if (!set_option(td, argv[a])) {
+            fprintf(stderr, "Unknown option: %s\n", argv[a]);
+            return EXIT_FAILURE;
+        }
+    }
+
     apriltag_family_t *tf = tag36h11_create();
-    apriltag_detector_add_family(td, tf);
+    if (decode_table) {
+        if (apriltag_family_save_decode_table(tf, 2, decode_table)) {
+            fprintf(stderr, "Failed to save %s\n", decode_table);
+            return EXIT_FAILURE;
+        }
+        // a table for another number of bits must be refused.
+        if (apriltag_detector_add_family_bits_mapped(td, tf, 1, decode_table) == 0 ||
+            apriltag_detector_add_family_bits_mapped(td, tf, 2, decode_table)) {
+            fprintf(stderr, "Failed to map %s\n", decode_table);
+            return EXIT_FAILURE;
+        }
+    } else {
+        apriltag_detector_add_family(td, tf);
+    }
+
+    // another detector sharing the family mustn't take the decoder
+    // with it when it goes.
+    apriltag_detector_t *td_shared = apriltag_detector_create();
+    apriltag_detector_add_family(td_shared, tf);
+    apriltag_detector_destroy(td_shared);
 
     const char fmt_det[] = "%i, (%.4lf %.4lf), (%.4lf %.4lf), (%.4lf %.4lf), (%.4lf %.4lf)";
     const char fmt_ref_parse[] = "%i, (%lf %lf), (%lf %lf), (%lf %lf), (%lf %lf)";
 
     bool ok = true;
 
+    if (fixed_point_tolerance >= 0 && !compare_fixed_point_sampling(td, im, fixed_point_tolerance / 1000.0)) {
+        ok = false;
+    }
+
+    if (pipeline_depth > 0 && !compare_pipeline(td, im, pipeline_depth)) {
+        ok = false;
+    }
+
     zarray_t *detections = apriltag_detector_detect(td, im);
 
+    // the caller-buffer API should find the same detections.
+    apriltag_detection_result_t results[64];
+    const int nresults = apriltag_detector_detect_into(td, im, results, 64);
+    if (nresults != zarray_size(detections)) {
+        fprintf(stderr, "detect_into found %d detections, expected %d\n", nresults, zarray_size(detections));
+        ok = false;
+    }
+    for (int j = 0; j < nresults && j < zarray_size(detections) && j < 64; j++) {
+        apriltag_detection_t *det;
+        zarray_get(detections, j, &det);
+
+        if (results[j].id != det->id || results[j].hamming != det->hamming ||
+            memcmp(results[j].p, det->p, sizeof(det->p)) ||
+            memcmp(results[j].H, det->H->data, sizeof(results[j].H))) {
+            fprintf(stderr, "detect_into mismatch at detection %d\n", j);
+            ok = false;
+        }
+    }
+
     // sort detections by detected corners for deterministic sorting order
     zarray_sort(detections, detection_array_element_compare_function);
 